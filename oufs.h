@@ -19,6 +19,9 @@
 // Implementation of min operator
 #define MIN(a, b) (((a) > (b)) ? (b) : (a))
 
+// Implementation of max operator
+#define MAX(a, b) (((a) < (b)) ? (b) : (a))
+
 /**********************************************************************/
 // Default virtual disk parameters (used if they are not yet defined)
 #ifndef BLOCK_SIZE
@@ -75,6 +78,12 @@ typedef unsigned short INODE_REFERENCE;
 // Size of file/directory name
 #define FILE_NAME_SIZE ((int)(16 - sizeof(INODE_REFERENCE)))
 
+// Longest file/directory name.  Names of up to FILE_NAME_SIZE-1 characters
+//  are stored in the directory entry; longer ones keep their first
+//  LONG_NAME_PREFIX_SIZE characters there, and the rest in the name heap
+#define OUFS_MAX_NAME_LENGTH 63
+#define LONG_NAME_PREFIX_SIZE 10
+
 /**********************************************************************/
 // Data block: storage for file contents (project 4!)
 typedef struct data_block_s
@@ -96,6 +105,9 @@ typedef struct inode_s
   // Number of directory references to this inode
   unsigned char n_references;
 
+  // INODE_* flags (this byte used to be padding)
+  unsigned char flags;
+
   // Contents.  UNALLOCATED_BLOCK means that this entry is not used
   BLOCK_REFERENCE content;
 
@@ -104,6 +116,19 @@ typedef struct inode_s
   unsigned int size;
 } INODE;
 
+// Inode flags
+// File contents are stored inline: content is the inode reference of the
+//  first of a run of inode slots that hold the data
+#define INODE_INLINE_DATA 0x01
+// File data blocks are listed in an index block (content), which lets a
+//  file have holes: unallocated ranges that read as zeros
+#define INODE_INDEXED 0x02
+
+// Inline data lives in up to this many consecutive inode slots, all in
+//  the same inode block as the file's own inode
+#define OUFS_INLINE_MAX_SLOTS 4
+#define OUFS_INLINE_DATA_SIZE ((int)(OUFS_INLINE_MAX_SLOTS * sizeof(INODE)))
+
 // Number of inodes stored in each block
 #define N_INODES_PER_BLOCK ((int)(DATA_BLOCK_SIZE/sizeof(INODE)))
 
@@ -132,18 +157,56 @@ typedef struct master_block_s
   //       8        is byte 1, bit 7
   unsigned char inode_allocated_flag[N_INODES >> 3];
 
-  // Double-ended linked list representation for unallocated blocks
-  BLOCK_REFERENCE unallocated_front;
-  BLOCK_REFERENCE unallocated_end;
+  // 8 blocks per byte: One block per bit: 1 = allocated, 0 = free
+  //  (same layout as inode_allocated_flag).  A bitmap, rather than a
+  //  list, lets the allocator find runs of consecutive free blocks
+  unsigned char block_allocated_flag[N_BLOCKS >> 3];
+
+  // Copy-on-write clones: number of files sharing each data block in
+  //  addition to its first owner (0 = the block is not shared)
+  unsigned char block_shares[N_BLOCKS];
+
+  // OUFS_FORMAT_VERSION of the layout the disk was formatted with
+  unsigned char format_version;
+
+  // Number of clear bits in block_allocated_flag and inode_allocated_flag,
+  //  kept up to date by the allocation code so that free space can be
+  //  found without scanning the tables
+  unsigned short n_free_blocks;
+  unsigned short n_free_inodes;
 
 } MASTER_BLOCK;
 
+// On-disk layout version: bumped whenever the layout of a block changes
+//  1: directory entries record the type of what they refer to
+//  2: long names, with a name heap chained to the directory block
+//  3: free block and free inode counts in the master block
+#define OUFS_FORMAT_VERSION 3
+
+// Every block type must fit inside a block
+typedef char MASTER_BLOCK_FITS[(sizeof(MASTER_BLOCK) <= sizeof(DATA_BLOCK)) ? 1 : -1];
+
 /**********************************************************************/
 // Single directory element
 typedef struct directory_entry_s
 {
-  // Name of file/directory
-  char name[FILE_NAME_SIZE];
+  union {
+    // Name of file/directory (when name_length is 0)
+    char name[FILE_NAME_SIZE];
+
+    // Long name: the rest of it is at offset in the directory's name heap
+    struct {
+      char prefix[LONG_NAME_PREFIX_SIZE];
+      unsigned short hash;
+      unsigned short offset;
+    } long_name;
+  };
+
+  // INODE_TYPE of the inode (so that listings need not read the inode)
+  unsigned char type;
+
+  // 0 if the name is stored in the entry; otherwise the length of the long name
+  unsigned char name_length;
 
   // UNALLOCATED_INODE if this directory entry is non-existent
   INODE_REFERENCE inode_reference;
@@ -159,10 +222,31 @@ typedef struct directory_block_s
   DIRECTORY_ENTRY entry[N_DIRECTORY_ENTRIES_PER_BLOCK];
 } DIRECTORY_BLOCK;
 
+// The name heap holds the tails of the long names of a directory, in no
+//  particular order, along with the tails of removed names until the heap
+//  is compacted.  It lives in a chain of blocks starting at the next_block
+//  of the directory block; it ends with the last tail in use
+#define OUFS_MAX_NAME_HEAP_SIZE (N_DIRECTORY_ENTRIES_PER_BLOCK * (OUFS_MAX_NAME_LENGTH - LONG_NAME_PREFIX_SIZE))
+#define OUFS_MAX_NAME_HEAP_BLOCKS ((OUFS_MAX_NAME_HEAP_SIZE + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE)
+
+// A long name must be able to hold its prefix, hash and heap offset
+typedef char DIRECTORY_ENTRY_FITS[(sizeof(DIRECTORY_ENTRY) == 18 &&
+				   OUFS_MAX_NAME_LENGTH <= UCHAR_MAX) ? 1 : -1];
+
+/**********************************************************************/
+// Index block: the data blocks of an INODE_INDEXED file, in file order.
+//  UNALLOCATED_BLOCK marks a hole
+#define N_INDEX_ENTRIES_PER_BLOCK ((int)(DATA_BLOCK_SIZE / sizeof(BLOCK_REFERENCE)))
+
+typedef struct index_block_s
+{
+  BLOCK_REFERENCE block[N_INDEX_ENTRIES_PER_BLOCK];
+} INDEX_BLOCK;
+
 /**********************************************************************/
 // All-encompassing structure for a disk block
-// The union says that all 4 of these elements occupy overlapping bytes in 
-//  memory (hence, a block will only be one of these 4 at any given time)
+// The union says that all 5 of these elements occupy overlapping bytes in 
+//  memory (hence, a block will only be one of these 5 at any given time)
 
 typedef struct
 {
@@ -172,6 +256,7 @@ typedef struct
     MASTER_BLOCK master;
     INODE_BLOCK inodes;
     DIRECTORY_BLOCK directory;
+    INDEX_BLOCK index;
   } content;
 } BLOCK;
 
@@ -181,6 +266,82 @@ typedef struct
 
 #define MAX_BLOCKS_IN_FILE 100
 
+// An index block must be able to list every block of a file
+typedef char INDEX_BLOCK_FITS[(MAX_BLOCKS_IN_FILE <= N_INDEX_ENTRIES_PER_BLOCK) ? 1 : -1];
+
+// Writes are collected in a buffer of this many bytes per open file, and
+//  are only given blocks when the buffer is flushed
+#define OUFS_WRITE_BUFFER_SIZE (32 * DATA_BLOCK_SIZE)
+
+// Readahead window limits (in blocks) for sequential reads
+#define OUFS_READAHEAD_MIN 2
+#define OUFS_READAHEAD_MAX 16
+
+// Directory entry as returned by oufs_readdir(), with the full name
+typedef struct oudirent_s
+{
+  char name[OUFS_MAX_NAME_LENGTH + 1];
+  unsigned char type;
+  INODE_REFERENCE inode_reference;
+} OUDIRENT;
+
+// Directory in memory: see oufs_opendir() and oufs_directory_load()
+typedef struct oudir_s
+{
+  INODE_REFERENCE inode_reference;
+  INODE inode;
+
+  // Number of entries: these are sorted at the front of the block
+  int n_entries;
+
+  // Index of the next entry to return, within the directory block
+  int next_entry;
+  BLOCK block;
+
+  // Name heap: only read when a long name is needed.  heap_moved is set
+  //  when tails in use were moved (the heap then goes to new blocks)
+  int heap_loaded;
+  int heap_dirty;
+  int heap_moved;
+  int heap_size;
+  int n_heap_blocks;
+  BLOCK_REFERENCE heap_blocks[OUFS_MAX_NAME_HEAP_BLOCKS];
+  char heap[OUFS_MAX_NAME_HEAP_BLOCKS * DATA_BLOCK_SIZE];
+
+  // Last entry returned by oufs_readdir()
+  OUDIRENT dirent;
+} OUDIR;
+
+// Layout of the files on the disk: see oufs_fragmentation()
+typedef struct fragmentation_s
+{
+  // Files that have data blocks, and their data blocks
+  int n_files;
+  int n_blocks;
+
+  // Runs of consecutive data blocks (a contiguous file has one)
+  int n_extents;
+
+  // Files with more than one run
+  int n_fragmented;
+} FRAGMENTATION;
+
+// File system statistics (oufs_statfs())
+typedef struct oufs_statfs_s
+{
+  // Bytes of data per block
+  int block_size;
+
+  // Blocks and inodes, in total and free
+  int n_blocks;
+  int n_free_blocks;
+  int n_inodes;
+  int n_free_inodes;
+
+  // Longest file name
+  int max_name_length;
+} OUFS_STATFS;
+
 typedef struct oufile_s
 {
   INODE_REFERENCE inode_reference;
@@ -190,6 +351,34 @@ typedef struct oufile_s
   // Cache for file content details.  Use of these is optional
   int n_data_blocks;
   BLOCK_REFERENCE block_reference_cache[MAX_BLOCKS_IN_FILE];
+
+  // Number of leading entries of block_reference_cache that are known.
+  //  In read mode, the cache is filled in lazily as the file is read
+  int n_cached_blocks;
+
+  // Readahead state (read mode): the offset at which the next read is
+  //  expected if access is sequential, and the current window in blocks
+  int readahead_offset;
+  int readahead_blocks;
+
+  // Blocks reserved by oufs_fallocate() (write modes): they are marked as
+  //  allocated on the disk and are handed out, in order, as the file
+  //  grows.  Reserved blocks that are still unused are freed by oufs_fclose()
+  int n_reserved_blocks;
+  int next_reserved_block;
+  BLOCK_REFERENCE reserved_blocks[MAX_BLOCKS_IN_FILE];
+
+  // Written bytes that are not on the disk yet (write modes).  They end at
+  //  offset; write_buffer is allocated on the first write
+  unsigned char *write_buffer;
+  int n_buffered;
+
+  // Blocks promised to the buffered bytes: they are counted against the
+  //  free blocks of the disk, but are only picked when the buffer is flushed
+  int n_promised_blocks;
+
+  // Next file in the list of files that this program has open
+  struct oufile_s *next_open;
 } OUFILE;
 
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "oufs_lib.h"
 #include "virtual_disk.h"
@@ -20,7 +21,10 @@ int main(int argc, char** argv) {
     fprintf(stderr, "Usage: oufs_create <file name>\n");
   }
   else {
-    OUFILE *fp = oufs_fopen(cwd, argv[1], "a");
+    // If stdin is a regular file, its size says how much space to reserve
+    struct stat st;
+    int size_hint = (fstat(0, &st) == 0 && S_ISREG(st.st_mode)) ? st.st_size : 0;
+    OUFILE *fp = oufs_fopen_hint(cwd, argv[1], "a", size_hint);
     unsigned char buf[BUF_SIZE];
     if(fp != NULL) {
       int n;
@@ -6,13 +6,182 @@ CS3113
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include "oufs_lib.h"
 #include "virtual_disk.h"
 
 #define BUF_SIZE 1000
 
+// Number of block views handed to writev() at once
+#define N_VIEWS 16
+
+// Default ring for the pipelined mode
+#define N_PIPE_BUFFERS 4
+#define PIPE_BUFFER_SIZE (16 * DATA_BLOCK_SIZE)
+
+/**
+ * Ring of buffers between the reader thread and the writer
+ *
+ * - Slots are filled and drained in order; count is the number of full
+ *    slots.  A slot with len <= 0 marks the end of the file
+ */
+typedef struct ring_s
+{
+  OUFILE *fp;
+  int n_buffers;
+  int buffer_size;
+  unsigned char **data;
+  int *len;
+  int count;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} RING;
+
+/**
+ * Write a set of views to a file descriptor, coping with short writes
+ *
+ * @param fd File descriptor to write to
+ * @param iov Array of views
+ * @param iovcnt Number of views
+ * @return 0 if success; -1 if error
+ */
+static int write_views(int fd, struct iovec *iov, int iovcnt)
+{
+  while(iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if(n < 0)
+      return(-1);
+
+    // Skip past whatever was written
+    while(iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if(iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return(0);
+}
+
+/**
+ * Reader thread: fill the slots of the ring from the file, in order
+ *
+ * @param arg RING pointer
+ */
+static void *ring_reader(void *arg)
+{
+  RING *ring = (RING *) arg;
+  int len;
+
+  for(int slot = 0; ; slot = (slot + 1) % ring->n_buffers) {
+    pthread_mutex_lock(&ring->lock);
+    while(ring->count == ring->n_buffers)
+      pthread_cond_wait(&ring->not_full, &ring->lock);
+    pthread_mutex_unlock(&ring->lock);
+
+    // Only this thread uses the file system while the ring runs
+    len = oufs_fread(ring->fp, ring->data[slot], ring->buffer_size);
+
+    pthread_mutex_lock(&ring->lock);
+    ring->len[slot] = len;
+    ++ring->count;
+    pthread_cond_signal(&ring->not_empty);
+    pthread_mutex_unlock(&ring->lock);
+
+    if(len <= 0)
+      return(NULL);
+  }
+}
+
+/**
+ * Copy a file to a file descriptor through a ring of buffers: a reader
+ *   thread fills the buffers while this thread writes them out, so that
+ *   reading from the disk overlaps with writing the output
+ *
+ * @param fp OUFILE pointer (open for reading)
+ * @param fd File descriptor to write to
+ * @param n_buffers Number of buffers in the ring
+ * @param buffer_size Size of each buffer
+ * @return Number of bytes copied
+ *         -1 if error
+ */
+static long cat_pipelined(OUFILE *fp, int fd, int n_buffers, int buffer_size)
+{
+  RING ring;
+  pthread_t reader;
+  long total = 0;
+  int ret = 0;
+
+  ring.fp = fp;
+  ring.n_buffers = n_buffers;
+  ring.buffer_size = buffer_size;
+  ring.count = 0;
+  ring.data = (unsigned char **) calloc(n_buffers, sizeof(unsigned char *));
+  ring.len = (int *) calloc(n_buffers, sizeof(int));
+  if(ring.data == NULL || ring.len == NULL) {
+    free(ring.data);
+    free(ring.len);
+    return(-1);
+  }
+  for(int i = 0; i < n_buffers; ++i) {
+    if((ring.data[i] = (unsigned char *) malloc(buffer_size)) == NULL)
+      ret = -1;
+  }
+  pthread_mutex_init(&ring.lock, NULL);
+  pthread_cond_init(&ring.not_empty, NULL);
+  pthread_cond_init(&ring.not_full, NULL);
+
+  if(ret == 0 && pthread_create(&reader, NULL, ring_reader, &ring) == 0) {
+    for(int slot = 0; ; slot = (slot + 1) % n_buffers) {
+      pthread_mutex_lock(&ring.lock);
+      while(ring.count == 0)
+	pthread_cond_wait(&ring.not_empty, &ring.lock);
+      pthread_mutex_unlock(&ring.lock);
+
+      int len = ring.len[slot];
+      if(len <= 0)
+	break;
+
+      // Write the slot out, coping with short writes
+      for(int done = 0; done < len && ret == 0; ) {
+	ssize_t n = write(fd, ring.data[slot] + done, len - done);
+	if(n < 0)
+	  ret = -1;
+	else
+	  done += n;
+      }
+      total += len;
+
+      pthread_mutex_lock(&ring.lock);
+      --ring.count;
+      pthread_cond_signal(&ring.not_full);
+      pthread_mutex_unlock(&ring.lock);
+    }
+    pthread_join(reader, NULL);
+  }else{
+    ret = -1;
+  }
+
+  pthread_cond_destroy(&ring.not_full);
+  pthread_cond_destroy(&ring.not_empty);
+  pthread_mutex_destroy(&ring.lock);
+  for(int i = 0; i < n_buffers; ++i)
+    free(ring.data[i]);
+  free(ring.data);
+  free(ring.len);
+
+  return(ret == 0 ? total : -1);
+}
+
 int main(int argc, char** argv) {
   // Fetch the key environment vars
   char cwd[MAX_PATH_LENGTH];
@@ -21,22 +190,66 @@ int main(int argc, char** argv) {
 
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
+  // Optional pipelined mode: -p, and the shape of its ring
+  int pipelined = 0;
+  int n_buffers = N_PIPE_BUFFERS;
+  int buffer_size = PIPE_BUFFER_SIZE;
+  while(argc > 2 && argv[1][0] == '-') {
+    if(strcmp(argv[1], "-p") == 0) {
+      pipelined = 1;
+      --argc;
+      ++argv;
+    }else if(argc > 3 && strcmp(argv[1], "-n") == 0 && sscanf(argv[2], "%d", &n_buffers) == 1 &&
+	     n_buffers > 0) {
+      pipelined = 1;
+      argc -= 2;
+      argv += 2;
+    }else if(argc > 3 && strcmp(argv[1], "-b") == 0 && sscanf(argv[2], "%d", &buffer_size) == 1 &&
+	     buffer_size > 0) {
+      pipelined = 1;
+      argc -= 2;
+      argv += 2;
+    }else{
+      break;
+    }
+  }
+
   // Open the virtual disk
   virtual_disk_attach(disk_name, pipe_name_base);
 
   // Check parameters
   if(argc != 2) {
-    fprintf(stderr, "Usage: oufs_cat <file name>\n");
+    fprintf(stderr, "Usage: oufs_cat [-p] [-n <buffers>] [-b <buffer size>] <file name>\n");
+  }else if(pipelined) {
+    OUFILE *fp = oufs_fopen(cwd, argv[1], "r");
+    if(fp != NULL) {
+      struct timeval start, end;
+      gettimeofday(&start, NULL);
+      long total = cat_pipelined(fp, 1, n_buffers, buffer_size);
+      gettimeofday(&end, NULL);
+      oufs_fclose(fp);
+
+      double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+      if(total < 0)
+	fprintf(stderr, "Write Error\n");
+      else
+	fprintf(stderr, "%ld bytes in %.6f s (%.1f MB/s) with %d buffers of %d bytes\n",
+		total, seconds, seconds > 0 ? total / seconds / 1e6 : 0.0, n_buffers, buffer_size);
+    }
   }else{
     OUFILE *fp = oufs_fopen(cwd, argv[1], "r");
-    unsigned char buf[BUF_SIZE];
+    struct iovec views[N_VIEWS];
+    struct iovec pending[N_VIEWS];
     if(fp != NULL) {
       // Successfully opened the file for reading
       int n;
-      // Loop until the contents of the file are all printed to STDOUT
-      while((n = oufs_fread(fp, buf, BUF_SIZE)) != 0) {
-        if (write(1, buf, n) == -1) 
+      // Loop until the contents of the file are all printed to STDOUT:
+      //  the block payloads go straight from the cache to writev()
+      while((n = oufs_fread_views(fp, views, N_VIEWS, N_VIEWS * BUF_SIZE)) > 0) {
+        memcpy(pending, views, n * sizeof(struct iovec));
+        if (write_views(1, pending, n) == -1)
           fprintf(stderr, "Write Error");
+        oufs_release_views(views, n);
       }
 
       // Clean up
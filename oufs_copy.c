@@ -12,23 +12,23 @@ int main(int argc, char** argv) {
 
   oufs_get_environment(cwd, disk_name, pipe_name_base);
 
+  // Optional -c: clone (share data blocks) instead of copying them
+  int clone = 0;
+  if(argc > 1 && strcmp(argv[1], "-c") == 0) {
+    clone = 1;
+    --argc;
+    ++argv;
+  }
+
   // Open the virtual disk
   virtual_disk_attach(disk_name, pipe_name_base);
   if(argc != 3) {
-    fprintf(stderr, "Usage: oufs_copy <source file name> <destination file name>\n");
+    fprintf(stderr, "Usage: oufs_copy [-c] <source file name> <destination file name>\n");
     return(-1);
   }else{
-    OUFILE *fp_in = oufs_fopen(cwd, argv[1], "r");
-    OUFILE *fp_out = oufs_fopen(cwd, argv[2], "w");
-    unsigned char buf[1000];
-    if(fp_in != NULL && fp_out != NULL) {
-      int n;
-      while((n = oufs_fread(fp_in, buf, 1000)) != 0) {
-	      oufs_fwrite(fp_out, buf, n);
-      }
-    
-      oufs_fclose(fp_in);
-      oufs_fclose(fp_out);
+    int ret = oufs_copy_file(cwd, argv[1], argv[2], clone);
+    if(ret != 0) {
+      fprintf(stderr, "Error (%d)\n", ret);
     }
   }
 
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+/**
+ * Print a fragmentation summary
+ */
+static void report(char *when, FRAGMENTATION *frag)
+{
+  printf("%s: %d files, %d blocks, %d extents (%.2f per file), %d fragmented\n",
+	 when, frag->n_files, frag->n_blocks, frag->n_extents,
+	 frag->n_files > 0 ? (double) frag->n_extents / frag->n_files : 0.0,
+	 frag->n_fragmented);
+}
+
+int main(int argc, char **argv)
+{
+  // Get the environmental variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Optional -n: only report
+  int dry_run = 0;
+  if(argc == 2 && strcmp(argv[1], "-n") == 0) {
+    dry_run = 1;
+  }else if(argc != 1) {
+    fprintf(stderr, "Usage: oufs_defrag [-n]\n");
+    return(-1);
+  }
+
+  // Open the virtual disk
+  if(virtual_disk_attach(disk_name, pipe_name_base) != 0) {
+    return(-1);
+  }
+
+  FRAGMENTATION frag;
+  if(oufs_fragmentation(&frag) != 0) {
+    virtual_disk_detach();
+    return(-1);
+  }
+  report("Before", &frag);
+
+  if(!dry_run) {
+    // Moving a file can open up a run for another: repeat while that helps
+    int n, total = 0;
+    while((n = oufs_defrag()) > 0)
+      total += n;
+    if(n < 0) {
+      fprintf(stderr, "Error (%d)\n", n);
+    }
+    printf("Moved %d files\n", total);
+
+    oufs_fragmentation(&frag);
+    report("After", &frag);
+  }
+
+  // Clean up
+  virtual_disk_detach();
+
+  return(0);
+}
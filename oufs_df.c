@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+/**
+ * Print one line of the report
+ */
+static void report(char *what, int total, int n_free)
+{
+  printf("%-8s %8d %8d %8d %4d%%\n", what, total, total - n_free, n_free,
+	 (total > 0) ? (100 * (total - n_free) + total - 1) / total : 0);
+}
+
+int main(int argc, char **argv)
+{
+  // Get the environmental variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Open the virtual disk
+  if(virtual_disk_attach(disk_name, pipe_name_base) != 0) {
+    return(-1);
+  }
+
+  OUFS_STATFS st;
+  int ret = oufs_statfs(&st);
+  if(ret < 0) {
+    fprintf(stderr, "Error (%d)\n", ret);
+  }else{
+    printf("%-8s %8s %8s %8s %5s\n", "", "Size", "Used", "Free", "Use%");
+    report("Blocks", st.n_blocks, st.n_free_blocks);
+    report("Inodes", st.n_inodes, st.n_free_inodes);
+    report("Bytes", st.n_blocks * st.block_size, st.n_free_blocks * st.block_size);
+  }
+
+  // Clean up
+  virtual_disk_detach();
+
+  return(ret < 0);
+}
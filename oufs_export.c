@@ -0,0 +1,187 @@
+/**
+Copy a directory tree of the OU File System to the host.
+
+CS3113
+
+*/
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+// Block views handed to writev() at once: enough for a whole file
+#define N_VIEWS MAX_BLOCKS_IN_FILE
+
+static char cwd[MAX_PATH_LENGTH];
+
+// Totals for the report
+static int n_files = 0;
+static int n_directories = 0;
+static long n_bytes = 0;
+static int n_errors = 0;
+
+/**
+ * Write a set of views to a file descriptor, coping with short writes
+ *
+ * @param fd File descriptor to write to
+ * @param iov Array of views
+ * @param iovcnt Number of views
+ * @return 0 if success; -1 if error
+ */
+static int write_views(int fd, struct iovec *iov, int iovcnt)
+{
+  while(iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if(n < 0)
+      return(-1);
+
+    // Skip past whatever was written
+    while(iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if(iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return(0);
+}
+
+/**
+ * Copy one file to the host
+ *
+ * - The block payloads go straight from the cache to a single writev()
+ *
+ * @param path Absolute path of the file
+ * @param host_path Path of the host file to create
+ * @return 0 if success; -1 if error
+ */
+static int export_file(char *path, char *host_path)
+{
+  OUFILE *fp = oufs_fopen(cwd, path, "r");
+  if(fp == NULL) {
+    fprintf(stderr, "%s: cannot open\n", path);
+    return(-1);
+  }
+  int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    perror(host_path);
+    oufs_fclose(fp);
+    return(-1);
+  }
+
+  struct iovec views[N_VIEWS];
+  struct iovec pending[N_VIEWS];
+  int ret = 0;
+  int n;
+  while((n = oufs_fread_views(fp, views, N_VIEWS, N_VIEWS * DATA_BLOCK_SIZE)) > 0) {
+    memcpy(pending, views, n * sizeof(struct iovec));
+    for(int i = 0; i < n; ++i)
+      n_bytes += views[i].iov_len;
+    if(write_views(fd, pending, n) != 0) {
+      perror(host_path);
+      ret = -1;
+    }
+    oufs_release_views(views, n);
+  }
+
+  close(fd);
+  oufs_fclose(fp);
+  if(ret == 0)
+    ++n_files;
+  return(ret);
+}
+
+/**
+ * Copy a directory tree to the host
+ *
+ * @param path Absolute path of the directory
+ * @param host_path Path of the host directory to copy it to (created if it
+ *    does not exist)
+ */
+static void export_directory(char *path, char *host_path)
+{
+  OUDIR *dp = oufs_opendir(cwd, path);
+  if(dp == NULL) {
+    fprintf(stderr, "%s: not a directory\n", path);
+    ++n_errors;
+    return;
+  }
+  if(mkdir(host_path, 0755) == 0) {
+    ++n_directories;
+  }else if(errno != EEXIST) {
+    perror(host_path);
+    ++n_errors;
+    oufs_closedir(dp);
+    return;
+  }
+
+  OUDIRENT *entry;
+  while((entry = oufs_readdir(dp)) != NULL) {
+    if(strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0)
+      continue;
+
+    char child[MAX_PATH_LENGTH];
+    char host_child[PATH_MAX];
+    snprintf(child, MAX_PATH_LENGTH, "%s/%s", strcmp(path, "/") == 0 ? "" : path, entry->name);
+    snprintf(host_child, PATH_MAX, "%s/%s", host_path, entry->name);
+    if(entry->type == DIRECTORY_TYPE) {
+      export_directory(child, host_child);
+    }else if(export_file(child, host_child) != 0) {
+      ++n_errors;
+    }
+  }
+  oufs_closedir(dp);
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  char path[MAX_PATH_LENGTH];
+
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  if(argc != 3) {
+    fprintf(stderr, "Usage: oufs_export <directory> <host directory>\n");
+    return(-1);
+  }
+
+  // Source as an absolute path
+  if(snprintf(path, MAX_PATH_LENGTH, "%s%s%s", argv[1][0] == '/' || strlen(cwd) <= 1 ? "" : cwd,
+	      argv[1][0] == '/' ? "" : "/", argv[1]) >= MAX_PATH_LENGTH) {
+    fprintf(stderr, "Path too long\n");
+    return(-1);
+  }
+  int len = strlen(path);
+  while(len > 1 && path[len-1] == '/')
+    path[--len] = 0;
+
+  // Open the virtual disk
+  virtual_disk_attach(disk_name, pipe_name_base);
+
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  export_directory(path, argv[2]);
+  gettimeofday(&end, NULL);
+
+  // Clean up
+  virtual_disk_detach();
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  fprintf(stderr, "%d files, %d directories, %ld bytes in %.3f s (%.0f files/s); %d errors\n",
+	  n_files, n_directories, n_bytes, seconds,
+	  seconds > 0 ? n_files / seconds : 0.0, n_errors);
+
+  return(n_errors == 0 ? 0 : 1);
+}
@@ -10,8 +10,11 @@ int main(int argc, char **argv)
   char pipe_name_base[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, disk_name,  pipe_name_base);
 
+  // Optional -f: fast format (the disk is emptied rather than written)
+  int fast = (argc > 1 && strcmp(argv[1], "-f") == 0);
+
   // Format the disk
-  oufs_format_disk(disk_name, pipe_name_base);
+  oufs_format_disk(disk_name, pipe_name_base, fast);
 
   return(0);
 
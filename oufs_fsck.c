@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+int main(int argc, char **argv)
+{
+  // Get the environmental variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Optional -r: repair the problems that are found
+  int repair = 0;
+  if(argc == 2 && strcmp(argv[1], "-r") == 0) {
+    repair = 1;
+  }else if(argc != 1) {
+    fprintf(stderr, "Usage: oufs_fsck [-r]\n");
+    return(-1);
+  }
+
+  // Open the virtual disk
+  if(virtual_disk_attach(disk_name, pipe_name_base) != 0) {
+    return(-1);
+  }
+
+  int n_repaired = 0;
+  int n = oufs_check(repair, &n_repaired);
+  if(n < 0) {
+    fprintf(stderr, "Error (%d)\n", n);
+  }else if(repair) {
+    printf("%d problems found, %d repaired\n", n, n_repaired);
+  }else{
+    printf("%d problems found\n", n);
+  }
+
+  // Clean up
+  virtual_disk_detach();
+
+  return(n == 0 ? 0 : 1);
+}
@@ -0,0 +1,184 @@
+/**
+Copy a host directory tree into the OU File System.
+
+CS3113
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+// Largest file that the file system can hold
+#define MAX_FILE_SIZE (MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE)
+
+static char cwd[MAX_PATH_LENGTH];
+
+// Totals for the report
+static int n_files = 0;
+static int n_directories = 0;
+static long n_bytes = 0;
+static int n_errors = 0;
+
+// One buffer holds a whole file, so that each file is a single write
+static unsigned char buffer[MAX_FILE_SIZE + 1];
+
+/**
+ * Copy one host file into the file system
+ *
+ * - The whole file is read at once, and its size is passed to
+ *    oufs_fopen_hint(): its blocks are reserved as one run and written
+ *    by a single flush when the file is closed
+ *
+ * @param host_path Path of the host file
+ * @param path Absolute path of the new file
+ * @return 0 if success; -1 if error
+ */
+static int import_file(char *host_path, char *path)
+{
+  int fd = open(host_path, O_RDONLY);
+  if(fd < 0) {
+    perror(host_path);
+    return(-1);
+  }
+
+  // Read up to one byte too many, to find files that do not fit
+  int size = 0;
+  int n;
+  while(size <= MAX_FILE_SIZE && (n = read(fd, buffer + size, MAX_FILE_SIZE + 1 - size)) > 0)
+    size += n;
+  close(fd);
+  if(size > MAX_FILE_SIZE) {
+    fprintf(stderr, "%s: too large (more than %d bytes)\n", host_path, MAX_FILE_SIZE);
+    return(-1);
+  }
+
+  OUFILE *fp = oufs_fopen_hint(cwd, path, "w", size);
+  if(fp == NULL) {
+    fprintf(stderr, "%s: cannot create\n", path);
+    return(-1);
+  }
+  // Small files are only buffered by oufs_fwrite(): the flush says whether
+  //  they made it to the disk
+  int ret = (size == 0 || (oufs_fwrite(fp, buffer, size) == size && oufs_fflush(fp) == 0)) ?
+    0 : -1;
+  oufs_fclose(fp);
+  if(ret != 0) {
+    // Do not leave a partial copy behind
+    oufs_remove(cwd, path);
+    fprintf(stderr, "%s: out of space\n", path);
+    return(-1);
+  }
+
+  ++n_files;
+  n_bytes += size;
+  return(0);
+}
+
+/**
+ * Copy a host directory tree into the file system
+ *
+ * @param host_path Path of the host directory
+ * @param path Absolute path of the directory to copy it to (created if it
+ *    does not exist)
+ */
+static void import_directory(char *host_path, char *path)
+{
+  // Create the directory unless it is already there
+  OUDIR *dp = oufs_opendir(cwd, path);
+  if(dp != NULL) {
+    oufs_closedir(dp);
+  }else if(oufs_mkdir(cwd, path) != 0) {
+    fprintf(stderr, "%s: cannot create\n", path);
+    ++n_errors;
+    return;
+  }else{
+    ++n_directories;
+  }
+
+  DIR *dir = opendir(host_path);
+  if(dir == NULL) {
+    perror(host_path);
+    ++n_errors;
+    return;
+  }
+
+  struct dirent *entry;
+  while((entry = readdir(dir)) != NULL) {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+
+    char host_child[PATH_MAX];
+    char child[MAX_PATH_LENGTH];
+    struct stat st;
+    snprintf(host_child, PATH_MAX, "%s/%s", host_path, entry->d_name);
+    if(snprintf(child, MAX_PATH_LENGTH, "%s/%s", strcmp(path, "/") == 0 ? "" : path,
+		entry->d_name) >= MAX_PATH_LENGTH ||
+       strlen(entry->d_name) > OUFS_MAX_NAME_LENGTH) {
+      fprintf(stderr, "%s: name too long\n", host_child);
+      ++n_errors;
+      continue;
+    }
+    if(stat(host_child, &st) != 0) {
+      perror(host_child);
+      ++n_errors;
+    }else if(S_ISDIR(st.st_mode)) {
+      import_directory(host_child, child);
+    }else if(S_ISREG(st.st_mode)) {
+      if(import_file(host_child, child) != 0)
+	++n_errors;
+    }
+  }
+  closedir(dir);
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  char path[MAX_PATH_LENGTH];
+
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  if(argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: oufs_import <host directory> [<directory>]\n");
+    return(-1);
+  }
+
+  // Destination: an absolute path, by default the current directory
+  char *dst = (argc == 3) ? argv[2] : "";
+  if(dst[0] == '/' || strlen(cwd) <= 1)
+    snprintf(path, MAX_PATH_LENGTH, "%s%s", dst[0] == '/' ? "" : "/", dst);
+  else
+    snprintf(path, MAX_PATH_LENGTH, "%s%s%s", cwd, dst[0] ? "/" : "", dst);
+  int len = strlen(path);
+  while(len > 1 && path[len-1] == '/')
+    path[--len] = 0;
+
+  // Open the virtual disk
+  virtual_disk_attach(disk_name, pipe_name_base);
+
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  import_directory(argv[1], path);
+  gettimeofday(&end, NULL);
+
+  // Clean up
+  virtual_disk_detach();
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  fprintf(stderr, "%d files, %d directories, %ld bytes in %.3f s (%.0f files/s); %d errors\n",
+	  n_files, n_directories, n_bytes, seconds,
+	  seconds > 0 ? n_files / seconds : 0.0, n_errors);
+
+  return(n_errors == 0 ? 0 : 1);
+}
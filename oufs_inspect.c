@@ -13,6 +13,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "oufs_lib_support.h"
@@ -20,6 +21,262 @@
 // NOTE: this is the only oufs exeutable that should include this file
 #include "virtual_disk.h"
 
+// Block map characters for -analyze
+#define MAP_FREE '.'
+#define MAP_MASTER 'M'
+#define MAP_INODES 'i'
+#define MAP_DIRECTORY 'd'
+#define MAP_NAME_HEAP 'h'
+#define MAP_INDEX 'x'
+#define MAP_FILE 'f'
+#define MAP_FRAGMENTED 'F'
+#define MAP_LEAKED '?'
+#define MAP_CONFLICT '!'
+
+// Number of file size classes: empty or inline, then up to 1, 2, 4, ... blocks
+#define N_SIZE_CLASSES 9
+
+// Number of directory fill classes (quarters)
+#define N_FILL_CLASSES 4
+
+/**
+ * Is bit i of an allocation bitmap set?  (byte i/8, bit 7 is the first)
+ */
+static int bit_is_set(unsigned char *flags, int i)
+{
+  return((flags[i >> 3] >> (7 - (i & 7))) & 1);
+}
+
+/**
+ * Record the owner of a block in the block map
+ */
+static void map_block(char *map, BLOCK_REFERENCE b, char owner)
+{
+  if(b >= N_BLOCKS)
+    return;
+  if(map[b] == MAP_FREE || map[b] == MAP_LEAKED || map[b] == owner)
+    map[b] = owner;
+  else
+    map[b] = MAP_CONFLICT;
+}
+
+/**
+ * Walk the directory tree below d, and mark the inode slots that hold the
+ *   inline data of the files found
+ *
+ * @param d Inode reference of the directory
+ * @param seen One flag per inode, so that each inode is visited once
+ * @param inline_slot One flag per inode slot, set for inline data slots
+ */
+static void find_inline_slots(INODE_REFERENCE d, unsigned char *seen, unsigned char *inline_slot)
+{
+  OUDIR *dir = (OUDIR *) malloc(sizeof(OUDIR));
+  if(dir == NULL || oufs_directory_load(d, NULL, dir) != 0) {
+    free(dir);
+    return;
+  }
+
+  for(int j = 0; j < dir->n_entries; ++j) {
+    INODE_REFERENCE child = dir->block.content.directory.entry[j].inode_reference;
+    INODE inode;
+    if(child >= N_INODES || seen[child] || oufs_read_inode_by_reference(child, &inode) != 0)
+      continue;
+    seen[child] = 1;
+
+    if(inode.type == DIRECTORY_TYPE) {
+      find_inline_slots(child, seen, inline_slot);
+    }else if(inode.type == FILE_TYPE && (inode.flags & INODE_INLINE_DATA)) {
+      int n = (inode.size + sizeof(INODE) - 1) / sizeof(INODE);
+      for(int k = inode.content; k < inode.content + n && k < N_INODES; ++k)
+	inline_slot[k] = 1;
+    }
+  }
+  free(dir);
+}
+
+/**
+ * Report the space usage and fragmentation of the whole disk
+ *
+ * The directory tree is walked first, to find the inode slots that hold
+ *  inline data rather than inodes.  Then the master block and each inode
+ *  block are read once, and every other allocated inode's blocks are
+ *  followed once.  Blocks that are allocated but not used by any inode are
+ *  shown as '?'; blocks used twice (other than by clones) or used but free
+ *  are shown as '!'.
+ *
+ * @return 0 if success
+ *         -x if error
+ */
+static int analyze()
+{
+  BLOCK master;
+  BLOCK block;
+  char map[N_BLOCKS];
+  BLOCK_REFERENCE refs[MAX_BLOCKS_IN_FILE];
+  int size_classes[N_SIZE_CLASSES] = {0};
+  int fill_classes[N_FILL_CLASSES] = {0};
+  unsigned char seen[N_INODES] = {0};
+  unsigned char inline_slot[N_INODES] = {0};
+  int n_inodes = 0, n_inline_slots = 0, n_files = 0, n_directories = 0;
+  int n_file_blocks = 0, n_extents = 0, n_fragmented = 0, n_entries = 0;
+
+  if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0) {
+    fprintf(stderr, "Error reading master block\n");
+    return(-1);
+  }
+
+  // Start from the allocation bitmap: every allocated block is leaked
+  //  until an inode claims it
+  for(int b = 0; b < N_BLOCKS; ++b)
+    map[b] = bit_is_set(master.content.master.block_allocated_flag, b) ? MAP_LEAKED : MAP_FREE;
+  map_block(map, MASTER_BLOCK_REFERENCE, MAP_MASTER);
+  for(int b = 1; b <= N_INODE_BLOCKS; ++b)
+    map_block(map, b, MAP_INODES);
+
+  seen[ROOT_DIRECTORY_INODE] = 1;
+  find_inline_slots(ROOT_DIRECTORY_INODE, seen, inline_slot);
+
+  for(int ib = 0; ib < N_INODE_BLOCKS; ++ib) {
+    BLOCK inodes;
+    if(virtual_disk_read_block(ib + 1, &inodes) != 0) {
+      fprintf(stderr, "Error reading inode block %d\n", ib + 1);
+      return(-2);
+    }
+
+    for(int k = 0; k < N_INODES_PER_BLOCK; ++k) {
+      int i = ib * N_INODES_PER_BLOCK + k;
+      INODE *inode = &inodes.content.inodes.inode[k];
+      if(i >= N_INODES || !bit_is_set(master.content.master.inode_allocated_flag, i))
+	continue;
+      if(inline_slot[i]) {
+	// Raw bytes of a small file, not an inode
+	++n_inline_slots;
+	continue;
+      }
+      ++n_inodes;
+
+      if(inode->type == DIRECTORY_TYPE) {
+	++n_directories;
+	n_entries += inode->size;
+	fill_classes[MIN(inode->size * N_FILL_CLASSES / N_DIRECTORY_ENTRIES_PER_BLOCK,
+			 N_FILL_CLASSES - 1)]++;
+	map_block(map, inode->content, MAP_DIRECTORY);
+
+	// Name heap chain
+	if(virtual_disk_read_block(inode->content, &block) != 0)
+	  continue;
+	BLOCK_REFERENCE h = block.next_block;
+	for(int n = 0; h < N_BLOCKS && n < OUFS_MAX_NAME_HEAP_BLOCKS; ++n) {
+	  map_block(map, h, MAP_NAME_HEAP);
+	  if(virtual_disk_read_block(h, &block) != 0)
+	    break;
+	  h = block.next_block;
+	}
+
+      }else if(inode->type == FILE_TYPE) {
+	++n_files;
+	int n = oufs_load_block_map(inode, refs);
+	int n_used = 0, n_runs = 0;
+	for(int j = 0; j < n; ++j) {
+	  if(refs[j] == UNALLOCATED_BLOCK)
+	    continue;
+	  ++n_used;
+	  if(j == 0 || refs[j] != refs[j - 1] + 1)
+	    ++n_runs;
+	}
+
+	// Size class: the number of blocks, rounded up to a power of 2
+	int c = 0;
+	if(!(inode->flags & INODE_INLINE_DATA) && inode->size > 0) {
+	  int n_blocks = (inode->size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+	  for(c = 1; c < N_SIZE_CLASSES - 1 && (1 << (c - 1)) < n_blocks; ++c)
+	    ;
+	}
+	++size_classes[c];
+
+	if(inode->flags & INODE_INDEXED)
+	  map_block(map, inode->content, MAP_INDEX);
+	n_file_blocks += n_used;
+	n_extents += n_runs;
+	if(n_runs > 1)
+	  ++n_fragmented;
+
+	// Clones share their chains, so a block that is already a file
+	//  block is not a conflict
+	for(int j = 0; j < n; ++j) {
+	  if(refs[j] >= N_BLOCKS)
+	    continue;
+	  if(map[refs[j]] == MAP_FILE || map[refs[j]] == MAP_FRAGMENTED)
+	    map[refs[j]] = (n_runs > 1) ? MAP_FRAGMENTED : map[refs[j]];
+	  else
+	    map_block(map, refs[j], (n_runs > 1) ? MAP_FRAGMENTED : MAP_FILE);
+	}
+      }
+    }
+  }
+
+  // Free space, from the bitmap
+  int n_free = 0, largest_run = 0, largest_start = -1;
+  for(int b = 0, run = 0; b <= N_BLOCKS; ++b) {
+    if(b < N_BLOCKS && !bit_is_set(master.content.master.block_allocated_flag, b)) {
+      ++n_free;
+      ++run;
+      if(map[b] != MAP_FREE)
+	map[b] = MAP_CONFLICT;
+    }else{
+      if(run > largest_run) {
+	largest_run = run;
+	largest_start = b - run;
+      }
+      run = 0;
+    }
+  }
+
+  printf("Blocks: %d of %d used (%.1f%%), %d free\n", N_BLOCKS - n_free, N_BLOCKS,
+	 100.0 * (N_BLOCKS - n_free) / N_BLOCKS, n_free);
+  printf("Largest free run: %d blocks", largest_run);
+  if(largest_start >= 0)
+    printf(" (from block %d)", largest_start);
+  printf("\n");
+  printf("Inodes: %d of %d used (%.1f%%): %d inodes, %d inline data slots\n",
+	 n_inodes + n_inline_slots, N_INODES, 100.0 * (n_inodes + n_inline_slots) / N_INODES,
+	 n_inodes, n_inline_slots);
+
+  printf("Files: %d, %d data blocks, %d extents, %d fragmented\n",
+	 n_files, n_file_blocks, n_extents, n_fragmented);
+  if(n_extents > 0)
+    printf("Extents per file: %.2f, blocks per extent: %.2f\n",
+	   (double) n_extents / (n_files - size_classes[0]), (double) n_file_blocks / n_extents);
+  printf("File sizes:\n");
+  printf("  %-16s %d\n", "empty/inline", size_classes[0]);
+  for(int c = 1; c < N_SIZE_CLASSES; ++c) {
+    char label[32];
+    if(c < N_SIZE_CLASSES - 1)
+      snprintf(label, sizeof(label), "<= %d block%s", 1 << (c - 1), (c == 1) ? "" : "s");
+    else
+      snprintf(label, sizeof(label), "> %d blocks", 1 << (c - 2));
+    printf("  %-16s %d\n", label, size_classes[c]);
+  }
+
+  printf("Directories: %d, %d entries", n_directories, n_entries);
+  if(n_directories > 0)
+    printf(" (%.1f%% full)", 100.0 * n_entries / (n_directories * N_DIRECTORY_ENTRIES_PER_BLOCK));
+  printf("\n");
+  printf("Directory fill:\n");
+  for(int c = 0; c < N_FILL_CLASSES; ++c)
+    printf("  %3d-%3d%%         %d\n", 100 * c / N_FILL_CLASSES,
+	   100 * (c + 1) / N_FILL_CLASSES, fill_classes[c]);
+
+  printf("Block map (%c master, %c inodes, %c directory, %c name heap, %c index,\n"
+	 "  %c file, %c fragmented file, %c free, %c leaked, %c conflict):\n",
+	 MAP_MASTER, MAP_INODES, MAP_DIRECTORY, MAP_NAME_HEAP, MAP_INDEX, MAP_FILE,
+	 MAP_FRAGMENTED, MAP_FREE, MAP_LEAKED, MAP_CONFLICT);
+  for(int b = 0; b < N_BLOCKS; b += 64)
+    printf("  %4d: %.*s\n", b, MIN(64, N_BLOCKS - b), map + b);
+
+  return(0);
+}
+
 int main(int argc, char** argv) {
   // Get the key environment variables
   char cwd[MAX_PATH_LENGTH];
@@ -50,14 +307,27 @@ int main(int argc, char** argv) {
 	for(int i = 0; i < N_INODES >> 3; ++i) {
 	  printf("%02x\n", block.content.master.inode_allocated_flag[i]);
 	}
-	printf("Unallocated front: %d\n", block.content.master.unallocated_front);
-	printf("Unallocated end: %d\n", block.content.master.unallocated_end);
+	printf("Format version: %d\n", block.content.master.format_version);
+	printf("Block table:\n");
+	for(int i = 0; i < N_BLOCKS >> 3; ++i) {
+	  printf("%02x\n", block.content.master.block_allocated_flag[i]);
+	}
+	printf("Shared blocks:\n");
+	for(int i = 0; i < N_BLOCKS; ++i) {
+	  if(block.content.master.block_shares[i] > 0)
+	    printf("%d: +%d\n", i, block.content.master.block_shares[i]);
+	}
       }
 
+    }else if(strncmp(argv[1], "-analyze", 9) == 0) {
+      // Space usage and fragmentation report
+      analyze();
+
     }else if(strncmp(argv[1], "-help", 6) == 0) {
       // User is asking for help
       printf("Usage:\n");
       printf("oufs_inspect -master\t\t Show the master block\n");
+      printf("oufs_inspect -analyze\t\t Report space usage, fragmentation and a block map\n");
       printf("oufs_inspect -help\t\t Print this help\n");
       printf("oufs_inspect -inode <#>\t\t Print contents of INODE #\n");
       printf("oufs_inspect -dblock <#>\t Print the contents of directory block #\n");
@@ -93,7 +363,12 @@ int main(int argc, char** argv) {
 	      break;
 	    }
 	  printf("Nreferences: %d\n", inode.n_references);
-	  printf("Content block: %d\n", inode.content);
+	  if(inode.flags & INODE_INLINE_DATA)
+	    printf("Inline data slots: %d ...\n", inode.content);
+	  else if(inode.flags & INODE_INDEXED)
+	    printf("Index block: %d\n", inode.content);
+	  else
+	    printf("Content block: %d\n", inode.content);
 	  printf("Size: %d\n", inode.size);
 	}
       }else{
@@ -115,12 +390,19 @@ int main(int argc, char** argv) {
 	  virtual_disk_read_block(index, &block);
 
 	  // display block data
-	  printf("Directory at block %d:\n", index);
+	  printf("Directory at block %d (name heap at %d):\n", index, block.next_block);
 	  for(int i = 0; i < N_DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-	    if(block.content.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-	      printf("Entry %d: name=\"%s\", inode=%d\n", i,
-		     block.content.directory.entry[i].name,
-		     block.content.directory.entry[i].inode_reference);
+	    DIRECTORY_ENTRY *entry = &block.content.directory.entry[i];
+	    if(entry->inode_reference == UNALLOCATED_INODE) {
+	      // Not in use
+	    }else if(entry->name_length == 0) {
+	      printf("Entry %d: name=\"%s\", inode=%d, type=%d\n", i,
+		     entry->name, entry->inode_reference, entry->type);
+	    }else{
+	      printf("Entry %d: name=\"%.*s...\" (length=%d, hash=%04x, heap offset=%d), inode=%d, type=%d\n", i,
+		     LONG_NAME_PREFIX_SIZE, entry->long_name.prefix, entry->name_length,
+		     entry->long_name.hash, entry->long_name.offset,
+		     entry->inode_reference, entry->type);
 	    }
 	  }
 	}
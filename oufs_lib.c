@@ -9,9 +9,8 @@
 #include "oufs_lib.h"
 #include "oufs_lib_support.h"
 #include "virtual_disk.h"
-
-// Yes ... a global variable
-int debug = 1;
+#include "oufs_metrics.h"
+#include "oufs_trace.h"
 
 // Translate inode types to descriptive strings
 const char *INODE_TYPE_NAME[] = {"UNUSED", "DIRECTORY", "FILE"};
@@ -70,19 +69,27 @@ void oufs_get_environment(char *cwd, char *disk_name,
  * NOTE: this function attaches to the virtual disk at the beginning and
  *  detaches after the format is complete.
  *
- * - Zero out all blocks on the disk.
- * - Initialize the master block: mark inode 0 as allocated and initialize
- *    the linked list of free blocks
- * - Initialize root directory inode 
+ * - Zero out all blocks on the disk.  A fast format empties the disk
+ *    file instead (with a single truncate, so the host allocates no
+ *    space for it)
+ * - Initialize the master block: mark inode 0 and the blocks up to the
+ *    root directory block as allocated
+ * - Initialize root directory inode.  A full format also initializes the
+ *    rest of the inode table; a fast format leaves it zeroed (free inodes
+ *    are initialized when they are allocated)
  * - Initialize the root directory in block ROOT_DIRECTORY_BLOCK
  *
+ * @param virtual_disk_name Name of the virtual disk
+ * @param pipe_name_base Base name of the pipes
+ * @param fast 1 for a fast format; 0 to write every block
  * @return 0 if no errors
  *         -x if an error has occurred.
  *
  */
 
-int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
+int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base, int fast)
 {
+  OUFS_MEASURE(OUFS_OP_FORMAT_DISK);
   // Attach to the virtual disk
   if(virtual_disk_attach(virtual_disk_name, pipe_name_base) != 0) {
     return(-1);
@@ -92,61 +99,54 @@ int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
 
   // Zero out the block
   memset(&block, 0, BLOCK_SIZE);
-  for(int i = 0; i < N_BLOCKS; ++i) {
-    if(virtual_disk_write_block(i, &block) < 0) {
+  if(fast) {
+    if(virtual_disk_clear() != 0) {
       return(-2);
     }
+  }else{
+    for(int i = 0; i < N_BLOCKS; ++i) {
+      if(virtual_disk_write_block(i, &block) < 0) {
+	return(-2);
+      }
+    }
   }
 
   //////////////////////////////
   // Master block
   block.next_block = UNALLOCATED_BLOCK;
   block.content.master.inode_allocated_flag[0] = 0x80;
+  block.content.master.format_version = OUFS_FORMAT_VERSION;
 
-  block.content.master.unallocated_front = 6;
-  block.content.master.unallocated_end = N_BLOCKS - 1;
+  // Master block, inode blocks and root directory block
+  for(int i = 0; i <= ROOT_DIRECTORY_BLOCK; ++i)
+    block.content.master.block_allocated_flag[i >> 3] |= (1 << (7 - (i & 7)));
+  oufs_count_free(&block);
 
   virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &block);
   memset(&block, 0, BLOCK_SIZE);
 
-  /*fprintf(stderr, "INSPECT 1 START: ---------------");
-  system("./oufs_inspect -data 1");
-  system("./oufs_inspect -inode 0");
-  system("./oufs_inspect -inode 1");*/
-
   //////////////////////////////
   // Root directory inode / block
   INODE inode;
   oufs_init_directory_structures(&inode, &block, ROOT_DIRECTORY_BLOCK,
 				 ROOT_DIRECTORY_INODE, ROOT_DIRECTORY_INODE);
-
-  // Write the results to the disk
-  if(oufs_write_inode_by_reference(0, &inode) != 0) {
-    return(-3);
-  }
-
   virtual_disk_write_block(ROOT_DIRECTORY_BLOCK, &block);
-  //////////////////////////////
-  // All other blocks are free blocks
-
-  memset(&block, 0, BLOCK_SIZE);
 
-  for (int i = 6; i < N_BLOCKS; i++) {
+  // Inode table: written a whole block at a time
+  for(int b = 0; b < (fast ? 1 : N_INODE_BLOCKS); ++b) {
     memset(&block, 0, BLOCK_SIZE);
-    if (i == N_BLOCKS - 1) {
-      block.next_block = UNALLOCATED_BLOCK;
-    }
-    else {
-      block.next_block = i + 1;
+    for(int i = 0; i < N_INODES_PER_BLOCK && b * N_INODES_PER_BLOCK + i < N_INODES && !fast; ++i)
+      block.content.inodes.inode[i].content = UNALLOCATED_INODE;
+    if(b == ROOT_DIRECTORY_INODE / N_INODES_PER_BLOCK)
+      block.content.inodes.inode[ROOT_DIRECTORY_INODE % N_INODES_PER_BLOCK] = inode;
+
+    // Write the results to the disk
+    if(virtual_disk_write_block(b + 1, &block) != 0) {
+      return(-3);
     }
-    virtual_disk_write_block(i, &block);
-  }
-
-  for (int i = 1; i < N_INODES; i++) {
-    memset(&inode, 0, sizeof(INODE));
-    inode.content = UNALLOCATED_INODE;
-    oufs_write_inode_by_reference(i, &inode);
   }
+  //////////////////////////////
+  // All other blocks are free blocks (already zeroed)
   
   // Done
   virtual_disk_detach();
@@ -154,48 +154,59 @@ int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base)
   return(0);
 }
 
-/*
- * Compare two inodes for sorting, handling the
- *  cases where the inodes are not valid
- *
- * @param e1 Pointer to a directory entry
- * @param e2 Pointer to a directory entry
- * @return -1 if e1 comes before e2 (or if e1 is the only valid one)
- * @return  0 if equal (or if both are invalid)
- * @return  1 if e1 comes after e2 (or if e2 is the only valid one)
+/**
+ * Discard all free blocks of the attached disk on the host, so that the
+ * virtual disk file only takes up space for blocks that are in use
  *
- * Note: this function is useful for qsort()
+ * @return The number of blocks discarded
+ *         -x if error
  */
-static int inode_compare_to(const void *d1, const void *d2)
+int oufs_trim()
 {
-  // Type casting from generic to DIRECTORY_ENTRY*
-  DIRECTORY_ENTRY* e1 = (DIRECTORY_ENTRY*) d1;
-  DIRECTORY_ENTRY* e2 = (DIRECTORY_ENTRY*) d2;
-  
-  if (e1->inode_reference == UNALLOCATED_INODE && e2->inode_reference != UNALLOCATED_INODE) {
-    return (1);
-  }
-  else if (e1->inode_reference != UNALLOCATED_INODE && e2->inode_reference == UNALLOCATED_INODE) {
-    return (-1);
-  }
-  else if (e1->inode_reference == UNALLOCATED_INODE && e2->inode_reference == UNALLOCATED_INODE) {
-    return (0);
-  }
-  else {
-    return strcmp(e1->name, e2->name);
+  OUFS_MEASURE(OUFS_OP_TRIM);
+  BLOCK master;
+
+  if(oufs_check_format() != 0 || virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0) {
+    return(-1);
   }
+
+  return(oufs_discard_free_blocks(&master));
 }
 
+/**
+ * Report the size and free space of the attached disk
+ * - Costs one read of the master block, which keeps the free counts
+ *
+ * @param st Filled in with the statistics
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_statfs(OUFS_STATFS *st)
+{
+  OUFS_MEASURE(OUFS_OP_STATFS);
+  BLOCK master;
+
+  if(oufs_check_format() != 0 ||
+     virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0) {
+    return(-1);
+  }
+
+  st->block_size = DATA_BLOCK_SIZE;
+  st->n_blocks = N_BLOCKS;
+  st->n_free_blocks = master.content.master.n_free_blocks;
+  st->n_inodes = N_INODES;
+  st->n_free_inodes = master.content.master.n_free_inodes;
+  st->max_name_length = OUFS_MAX_NAME_LENGTH;
+  return(0);
+}
 
 /**
  * Print out the specified file (if it exists) or the contents of the 
  *   specified directory (if it exists)
  *
  * If a directory is listed, then the valid contents are printed in sorted order
- *   (as defined by strcmp()), one per line.  We know that a directory entry is
- *   valid if the inode_reference is not UNALLOCATED_INODE.
- *   Hint: qsort() will do to sort for you.  You just have to provide a compareTo()
- *   function (just like in Java!)
+ *   (as defined by strcmp()), one per line.  Directories keep their entries
+ *   sorted, so they are printed in the order in which they are stored.
  *   Note: if an entry is a directory itself, then its name must be followed by "/"
  *
  * @param cwd Absolute path representing the current working directory
@@ -207,68 +218,156 @@ static int inode_compare_to(const void *d1, const void *d2)
 
 int oufs_list(char *cwd, char *path)
 {
+  OUFS_MEASURE(OUFS_OP_LIST);
+  return(oufs_list_prefix(cwd, path, ""));
+}
+
+
+/**
+ * Print out the specified file (if it exists) or the entries of the
+ *   specified directory whose names start with prefix, in sorted order
+ *
+ * - The first matching entry is found by binary search: entries that
+ *    do not match are never looked at
+ *
+ * @param cwd Absolute path representing the current working directory
+ * @param path Absolute or relative path to the file/directory
+ * @param prefix Prefix of the names to list ("" lists them all)
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_list_prefix(char *cwd, char *path, char *prefix)
+{
+  OUFS_MEASURE(OUFS_OP_LIST_PREFIX);
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
+  char local_name[MAX_PATH_LENGTH];
+  OUDIR dir;
 
   // Look up the inodes for the parent and child
-  int ret = oufs_find_file(cwd, path, &parent, &child, NULL);
+  int ret = oufs_find_file(cwd, path, &parent, &child, local_name);
 
   // Did we find the specified file?
   if(ret == 0 && child != UNALLOCATED_INODE) {
-    // Element found: read the inode
-    INODE inode;
-    if(oufs_read_inode_by_reference(child, &inode) != 0) {
-      return(-1);
+    int load = oufs_directory_load(child, NULL, &dir);
+    if(load == -1) {
+      // A file: just its name
+      printf("%s\n", local_name);
+      return(0);
     }
-    if(debug) {
-      fprintf(stderr, "\tDEBUG: Child found (type=%s).\n",  INODE_TYPE_NAME[inode.type]);
-    }
-
-
-    BLOCK b;
-    int count = 0;
-    //char* items[N_DIRECTORY_ENTRIES_PER_BLOCK] = { 0 };
-    DIRECTORY_ENTRY items[N_DIRECTORY_ENTRIES_PER_BLOCK];
-    virtual_disk_read_block(inode.content, &b);
-    for (int i = 0; i < N_DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-      if (b.content.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-        //oufs_read_inode_by_reference(b.content.directory.entry[i].inode_reference, &inode);
-        //strcpy(items[count], b.content.directory.entry[i].name);
-        items[count] = b.content.directory.entry[i];
-        /*if (inode.type == DIRECTORY_TYPE) {
-          strcat(items[count], "/");
-          //printf("%s/\n", b.content.directory.entry[i].name);
-        }*/
-        /*else if (inode.type == FILE_TYPE) {
-          printf("%s\n", b.content.directory.entry[i].name);
-        }*/
-
-        count++;
-      }
+    if(load != 0) {
+      return(-2);
     }
 
-    //fprintf(stderr, "AFTER: \n");
-    qsort(items, count, sizeof(DIRECTORY_ENTRY), inode_compare_to);
-    for (int i = 0; i < count; i++) {
-      oufs_read_inode_by_reference(items[i].inode_reference, &inode);
-      if (inode.type == DIRECTORY_TYPE) {
-        printf("%s/\n", items[i].name);
+    // The entry types tell directories apart: no inodes are read
+    int len = strlen(prefix);
+    OUDIRENT *entry;
+    oufs_seekdir(&dir, prefix);
+    while((entry = oufs_readdir(&dir)) != NULL && strncmp(entry->name, prefix, len) == 0) {
+      if (entry->type == DIRECTORY_TYPE) {
+        printf("%s/\n", entry->name);
       }
       else {
-        printf("%s\n", items[i].name);
+        printf("%s\n", entry->name);
       }
     }
   } else {
     // Did not find the specified file/directory
     fprintf(stderr, "Not found\n");
-    if(debug)
-      fprintf(stderr, "\tDEBUG: (%d)\n", ret);
+    OUFS_TRACE_EVENT(TRACE_LIST_ERROR, ret, 0);
   }
   // Done: return the status from the search
   return(ret);
 }
 
 
+/**
+ * Open a directory for reading its entries one at a time
+ *
+ * @param cwd Absolute path representing the current working directory
+ * @param path Absolute or relative path to the directory
+ * @return Pointer to a new OUDIR structure if success
+ *         NULL if the directory does not exist (or is not a directory)
+ */
+OUDIR *oufs_opendir(char *cwd, char *path)
+{
+  OUFS_MEASURE(OUFS_OP_OPENDIR);
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+
+  if(oufs_find_file(cwd, path, &parent, &child, NULL) != 0 || child == UNALLOCATED_INODE) {
+    return(NULL);
+  }
+
+  OUDIR *dp = (OUDIR *) malloc(sizeof(OUDIR));
+  if(dp == NULL) {
+    return(NULL);
+  }
+  if(oufs_directory_load(child, NULL, dp) != 0) {
+    free(dp);
+    return(NULL);
+  }
+
+  return(dp);
+}
+
+
+/**
+ * Return the next entry of an open directory
+ * - Entries come back sorted by name (as defined by strcmp())
+ * - The entry belongs to dp, and is only valid until the next call
+ *
+ * @param dp OUDIR pointer
+ * @return Pointer to the next entry
+ *         NULL if there are no more entries
+ */
+OUDIRENT *oufs_readdir(OUDIR *dp)
+{
+  OUFS_MEASURE(OUFS_OP_READDIR);
+  if(dp->next_entry >= dp->n_entries)
+    return(NULL);
+
+  DIRECTORY_ENTRY *entry = &dp->block.content.directory.entry[dp->next_entry];
+  if(oufs_directory_get_name(dp, dp->next_entry, dp->dirent.name) != 0)
+    return(NULL);
+  dp->dirent.type = entry->type;
+  dp->dirent.inode_reference = entry->inode_reference;
+  ++dp->next_entry;
+
+  return(&dp->dirent);
+}
+
+
+/**
+ * Position an open directory so that the next oufs_readdir() returns the
+ *   first entry whose name is not less than name
+ *
+ * - Use a prefix to list all of the names that start with it, or the last
+ *    name returned to continue a listing page by page
+ *
+ * @param dp OUDIR pointer
+ * @param name Name to seek to
+ */
+void oufs_seekdir(OUDIR *dp, char *name)
+{
+  OUFS_MEASURE(OUFS_OP_SEEKDIR);
+  int i = oufs_directory_search(dp, name);
+  dp->next_entry = (i >= 0) ? i : -(i + 1);
+}
+
+
+/**
+ * Close a directory opened by oufs_opendir()
+ *
+ * @param dp OUDIR pointer
+ */
+void oufs_closedir(OUDIR *dp)
+{
+  OUFS_MEASURE(OUFS_OP_CLOSEDIR);
+  free(dp);
+}
+
+
 
 
 ///////////////////////////////////
@@ -288,6 +387,7 @@ int oufs_list(char *cwd, char *path)
  */
 int oufs_mkdir(char *cwd, char *path)
 {
+  OUFS_MEASURE(OUFS_OP_MKDIR);
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
 
@@ -297,30 +397,52 @@ int oufs_mkdir(char *cwd, char *path)
 
   // Attempt to find the specified directory
   if((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
-    if(debug)
-      fprintf(stderr, "oufs_mkdir(): ret = %d\n", ret);
+    OUFS_TRACE_EVENT(TRACE_MKDIR_ERROR, ret, 0);
     return(-1);
   };
 
 
-  BLOCK b;
-  INODE parentInode;
-  INODE inode;
-  child = oufs_allocate_new_directory(parent);
+  OUDIR dir;
+
+  if(parent == UNALLOCATED_INODE || child != UNALLOCATED_INODE) {
+    fprintf(stderr, "Parent does not exist or child already exists\n");
+    return(-2);
+  }
+  if(oufs_directory_load(parent, NULL, &dir) != 0) {
+    return(-3);
+  }
 
-  oufs_read_inode_by_reference(child, &inode);
-  oufs_read_inode_by_reference(parent, &parentInode);
+  // Enter the name first: this checks that there is a free entry.  Room
+  //  for a long name in the name heap is only found when the directory is
+  //  written, after the new directory exists
+  int i = oufs_directory_insert(&dir, local_name, UNALLOCATED_INODE, DIRECTORY_TYPE);
+  if(i < 0) {
+    fprintf(stderr, "Cannot add %s to the parent directory.\n", local_name);
+    return(-3);
+  }
 
-  virtual_disk_read_block(parentInode.content, &b);
+  child = oufs_allocate_new_directory(parent);
+  if(child == UNALLOCATED_INODE) {
+    return(-4);
+  }
 
-  for (int i = 2; i < N_DIRECTORY_ENTRIES_PER_BLOCK - 1; i++) {
-    if (b.content.directory.entry[i].inode_reference == UNALLOCATED_INODE) {
-      b.content.directory.entry[i].inode_reference = child;
-      strcpy(b.content.directory.entry[i].name, local_name);
-      break;
+  dir.block.content.directory.entry[i].inode_reference = child;
+  if(oufs_directory_write(&dir) != 0) {
+    // No room for the name: free the new directory again
+    BLOCK master;
+    INODE c;
+    if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) == 0 &&
+       oufs_read_inode_by_reference(child, &c) == 0) {
+      oufs_mark_inode(&master, child, 0);
+      oufs_deallocate_block(&master, c.content);
+      memset(&c, 0, sizeof(INODE));
+      c.content = UNALLOCATED_BLOCK;
+      oufs_write_inode_by_reference(child, &c);
+      virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
     }
+    fprintf(stderr, "Cannot add %s to the parent directory.\n", local_name);
+    return(-5);
   }
-  virtual_disk_write_block(parentInode.content, &b);
 
   return (0);
 }
@@ -341,6 +463,7 @@ int oufs_mkdir(char *cwd, char *path)
  */
 int oufs_rmdir(char *cwd, char *path)
 {
+  OUFS_MEASURE(OUFS_OP_RMDIR);
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
   char local_name[MAX_PATH_LENGTH];
@@ -356,17 +479,15 @@ int oufs_rmdir(char *cwd, char *path)
 
   //Block and inode setup
   BLOCK master;
-  BLOCK pb;
-  BLOCK block;
+  OUDIR p;
   INODE c;
-  INODE p;
 
   //Read in appropriate values
   virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master);
   oufs_read_inode_by_reference(child, &c);
-  oufs_read_inode_by_reference(parent, &p);
-  virtual_disk_read_block(p.content, &pb);
-  virtual_disk_read_block(c.content, &block);
+  if (oufs_directory_load(parent, NULL, &p) != 0) {
+    return (-1);
+  }
 
   //Error checking
   if (c.type != DIRECTORY_TYPE) {
@@ -374,47 +495,73 @@ int oufs_rmdir(char *cwd, char *path)
     return (-1);
   }
 
-  if (p.size <= 2 || c.size > 2) {
+  if (p.n_entries <= 2 || c.size > 2) {
     fprintf(stderr, "Cannot remove: SIZE ERROR\n");
     return (-1);
   }
 
-  if (child == 0 || child == UNALLOCATED_INODE) {
+  if (child == 0 || child == UNALLOCATED_INODE ||
+      strcmp(local_name, ".") == 0 || strcmp(local_name, "..") == 0) {
     fprintf(stderr, "Cannot remove: INODE ERROR\n");
     return (-1);
   }
 
-  //Modify parent inode
-  p.size = p.size - 1;
-
-  //Modify parent directory block
-  for (int i = 0; i < N_DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-    if (pb.content.directory.entry[i].inode_reference == child) {
-      DIRECTORY_ENTRY dirEn;
-      memset(&dirEn, 0, sizeof(DIRECTORY_ENTRY));
-      dirEn.inode_reference = UNALLOCATED_INODE;
-      pb.content.directory.entry[i] = dirEn;
-      break;
-    }
+  //Modify parent directory
+  if (oufs_directory_remove(&p, local_name) != 0) {
+    return (-1);
   }
   
   //Modify master inode flag table
-  master.content.master.inode_allocated_flag[child/8] -= (1 << (7 - child%8));
+  oufs_mark_inode(&master, child, 0);
 
   //Make c a blank inode
-  oufs_deallocate_block(&master, c.content);
+  BLOCK_REFERENCE freed = c.content;
+  oufs_deallocate_block(&master, freed);
   memset(&c, 0, sizeof(INODE));
   c.content = UNALLOCATED_BLOCK;
 
   //Write the content back
   oufs_write_inode_by_reference(child, &c);
   virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
-  virtual_disk_write_block(p.content, &pb);
-  oufs_write_inode_by_reference(parent, &p);
+  oufs_discard_blocks(&freed, 1);
+  oufs_directory_write(&p);
   // Success
   return(0);
 }
 
+/*
+ * Set up the block map of a file that is being opened
+ * - Indexed files: the whole map comes from the index block
+ * - Chained files: either the whole chain is walked now (eager), or only
+ *    the first block is recorded and oufs_fread() discovers the rest of
+ *    the chain as it reads the data blocks
+ *
+ * @param fp OUFILE pointer
+ * @param inode Pointer to the loaded inode of the file
+ * @param eager 1 to load the whole map now
+ * @return 0 if success
+ *         -x if error
+ */
+static int oufs_file_init_block_map(OUFILE *fp, INODE *inode, int eager)
+{
+  fp->n_data_blocks = (inode->size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+  fp->n_cached_blocks = 0;
+
+  if((inode->flags & INODE_INLINE_DATA) || inode->content == UNALLOCATED_BLOCK) {
+    // No data blocks: the contents (if any) live with the inode
+    fp->n_data_blocks = 0;
+  }else if(eager || (inode->flags & INODE_INDEXED)) {
+    if(oufs_load_block_map(inode, fp->block_reference_cache) < 0)
+      return(-1);
+    fp->n_cached_blocks = fp->n_data_blocks;
+  }else{
+    fp->block_reference_cache[0] = inode->content;
+    fp->n_cached_blocks = 1;
+  }
+
+  return(0);
+}
+
 /**
  * Open a file
  * - mode = "r": the file must exist; offset is set to 0
@@ -436,6 +583,35 @@ int oufs_rmdir(char *cwd, char *path)
  */
 OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
 {
+  OUFS_MEASURE(OUFS_OP_FOPEN);
+  return(oufs_fopen_hint(cwd, path, mode, 0));
+}
+
+// Files that this program has open (so that a removed file can drop
+//  its buffered bytes)
+static OUFILE *open_files = NULL;
+
+// Blocks promised to the buffers of all of the open files
+static int n_promised_blocks = 0;
+
+/**
+ * Open a file, with a hint of how much will be written to it
+ * - Behaves like oufs_fopen()
+ * - mode = "w" or "a": if size_hint > 0, space for that many more bytes
+ *    is reserved with oufs_fallocate(), so that the file ends up in
+ *    consecutive blocks.  Not being able to reserve the space is not an
+ *    error
+ *
+ * @param cwd Absolute path for the current working directory
+ * @param path Relative or absolute path for the file in question
+ * @param mode String: one of "r", "w" or "a"
+ * @param size_hint Expected number of bytes to be written (0 if unknown)
+ * @return Pointer to a new OUFILE structure if success
+ *         NULL if error
+ */
+OUFILE* oufs_fopen_hint(char *cwd, char *path, char *mode, int size_hint)
+{
+  OUFS_MEASURE(OUFS_OP_FOPEN_HINT);
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
   char local_name[MAX_PATH_LENGTH];
@@ -450,8 +626,7 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
 
   // Try to find the inode of the child
   if((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
-    if(debug)
-      fprintf(stderr, "oufs_fopen(%d)\n", ret);
+    OUFS_TRACE_EVENT(TRACE_FOPEN_ERROR, ret, 0);
     return(NULL);
   }
   
@@ -462,72 +637,64 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
 
   // TODO
   OUFILE* fp = (OUFILE*)malloc(sizeof(OUFILE));
+  fp->mode = mode[0];
+  fp->offset = 0;
+  fp->n_data_blocks = 0;
+  fp->n_cached_blocks = 0;
+  fp->readahead_offset = 0;
+  fp->readahead_blocks = 0;
+  fp->n_reserved_blocks = 0;
+  fp->next_reserved_block = 0;
+  fp->write_buffer = NULL;
+  fp->n_buffered = 0;
+  fp->n_promised_blocks = 0;
+
   if (mode[0] == 'a') {
     if (child == UNALLOCATED_INODE) {
       child = oufs_create_file(parent, local_name);
-      if (child == UNALLOCATED_INODE)
+      if (child == UNALLOCATED_INODE) {
+        free(fp);
         return NULL;
-      
+      }
       fp->inode_reference = child;
-      fp->mode = 'a';
-      fp->offset = 0;
-      fp->n_data_blocks = 0;
     }
     else {
       oufs_read_inode_by_reference(child, &inode);
       fp->inode_reference = child;
-      fp->mode = 'a';
       fp->offset = inode.size;
-      fp->n_data_blocks = (fp->offset + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
-      
-      BLOCK b;
-      virtual_disk_read_block(inode.content, &b);
-      fp->block_reference_cache[0] = inode.content;
-      for (int i = 1; i < fp->n_data_blocks; i++) {
-        fp->block_reference_cache[i] = b.next_block;
-        if (b.next_block != UNALLOCATED_BLOCK)
-          virtual_disk_read_block(b.next_block, &b);
+      if (oufs_file_init_block_map(fp, &inode, 1) != 0) {
+        free(fp);
+        return NULL;
       }
-
     }
   }
   if (mode[0] == 'r') {
     //Child must exist
     if (child == UNALLOCATED_INODE) {
+      free(fp);
       return NULL;
     }
     else {
       oufs_read_inode_by_reference(child, &inode);
-      if (inode.type != FILE_TYPE)
+      if (inode.type != FILE_TYPE || oufs_file_init_block_map(fp, &inode, 0) != 0) {
+        free(fp);
         return NULL;
-      fp->inode_reference = child;
-      fp->mode = 'r';
-      fp->offset = 0;
-      fp->n_data_blocks = (inode.size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
-
-      BLOCK b;
-      virtual_disk_read_block(inode.content, &b);
-      fp->block_reference_cache[0] = inode.content;
-      for (int i = 1; i < fp->n_data_blocks; i++) {
-        fp->block_reference_cache[i] = b.next_block;
-        if (b.next_block != UNALLOCATED_BLOCK)
-          virtual_disk_read_block(b.next_block, &b);
       }
+      fp->inode_reference = child;
     }
   }
   if (mode[0] == 'w') {
     if (child == UNALLOCATED_INODE) {
       child = oufs_create_file(parent, local_name);
-      if (child == UNALLOCATED_INODE)
+      if (child == UNALLOCATED_INODE) {
+        free(fp);
         return NULL;
+      }
       /*inode.type = FILE_TYPE;
       inode.n_references = 1;
       inode.size = 0;
       inode.content = UNALLOCATED_BLOCK;*/
       fp->inode_reference = child;
-      fp->mode = 'w';
-      fp->offset = 0;
-      fp->n_data_blocks = 0;
     }
     else {
       oufs_read_inode_by_reference(child, &inode);
@@ -535,23 +702,114 @@ OUFILE* oufs_fopen(char *cwd, char *path, char *mode)
       oufs_write_inode_by_reference(child, &inode);
 
       fp->inode_reference = child;
-      fp->mode = 'w';
-      fp->offset = 0;
-      fp->n_data_blocks = 0;
     }
   }
+
+  if(fp->mode != 'r' && size_hint > 0)
+    oufs_fallocate(fp, size_hint);
+
+  fp->next_open = open_files;
+  open_files = fp;
   
   return(fp);
 };
 
+/**
+ * Reserve space for a file to grow into
+ * - Enough blocks are set aside for the file to reach offset + len bytes,
+ *    as one run of consecutive blocks if possible (preferably right after
+ *    the last block of the file).  Later writes use these blocks in order
+ * - The size of the file does not change; reserved blocks that have not
+ *    been written to when the file is closed are freed again
+ *
+ * @param fp OUFILE pointer (must be opened for w or a)
+ * @param len Number of bytes past the current offset
+ * @return 0 if success
+ *         -x if error, or if there is not enough free space
+ */
+int oufs_fallocate(OUFILE *fp, int len)
+{
+  OUFS_MEASURE(OUFS_OP_FALLOCATE);
+  BLOCK master;
+
+  if(fp->mode == 'r') {
+    fprintf(stderr, "Can't write to read-only file");
+    return(-1);
+  }
+
+  // Blocks needed beyond the end of the file and what is already reserved
+  int n_blocks = (MIN(fp->offset + len, MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE) +
+		  DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+  int n_new = n_blocks - fp->n_data_blocks - fp->n_reserved_blocks + fp->next_reserved_block;
+  if(n_new <= 0)
+    return(0);
+
+  if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0) {
+    return(-2);
+  }
+
+  // Used reserved entries can be dropped
+  int n_left = fp->n_reserved_blocks - fp->next_reserved_block;
+  memmove(fp->reserved_blocks, fp->reserved_blocks + fp->next_reserved_block,
+	  n_left * sizeof(BLOCK_REFERENCE));
+  fp->next_reserved_block = 0;
+  fp->n_reserved_blocks = n_left;
+
+  BLOCK_REFERENCE last = (n_left > 0) ? fp->reserved_blocks[n_left - 1] :
+    (fp->n_data_blocks > 0) ? fp->block_reference_cache[fp->n_data_blocks - 1] : UNALLOCATED_BLOCK;
+  BLOCK_REFERENCE goal = (last == UNALLOCATED_BLOCK) ? UNALLOCATED_BLOCK : last + 1;
+
+  // Blocks promised to the buffers of open files are not handed out
+  if(master.content.master.n_free_blocks - n_promised_blocks < n_new ||
+     oufs_allocate_blocks(&master, goal, n_new, fp->reserved_blocks + n_left) != 0) {
+    OUFS_TRACE_EVENT(TRACE_NO_BLOCKS, n_new, 0);
+    return(-3);
+  }
+  virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+  fp->n_reserved_blocks += n_new;
+
+  return(0);
+}
+
+static int oufs_file_flush(OUFILE *fp, int extra);
+
+/*
+ * Give up the blocks promised to the buffered bytes of an open file
+ */
+static void release_promised_blocks(OUFILE *fp)
+{
+  n_promised_blocks -= fp->n_promised_blocks;
+  fp->n_promised_blocks = 0;
+}
+
 /**
  *  Close a file
- *   Deallocates the OUFILE structure
+ *   Writes out any buffered bytes, frees any unused reserved blocks and
+ *   deallocates the OUFILE structure
  *
  * @param fp Pointer to the OUFILE structure
  */
      
 void oufs_fclose(OUFILE *fp) {
+  OUFS_MEASURE(OUFS_OP_FCLOSE);
+  oufs_file_flush(fp, 0);
+  free(fp->write_buffer);
+
+  OUFILE **link = &open_files;
+  while(*link != fp)
+    link = &(*link)->next_open;
+  *link = fp->next_open;
+
+  if(fp->next_reserved_block < fp->n_reserved_blocks) {
+    BLOCK master;
+    if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) == 0) {
+      for(int i = fp->next_reserved_block; i < fp->n_reserved_blocks; ++i)
+	oufs_deallocate_block(&master, fp->reserved_blocks[i]);
+      virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+      oufs_discard_blocks(fp->reserved_blocks + fp->next_reserved_block,
+			  fp->n_reserved_blocks - fp->next_reserved_block);
+    }
+  }
   fp->inode_reference = UNALLOCATED_INODE;
   free(fp);
 }
@@ -574,104 +832,609 @@ void oufs_fclose(OUFILE *fp) {
  */
 int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len)
 {
-  if(fp->mode == 'r') {
-    fprintf(stderr, "Can't write to read-only file");
-    return(0);
-  }
-  if(debug)
-    fprintf(stderr, "-------\noufs_fwrite(%d)\n", len);
-    
-  INODE inode;
-  BLOCK block;
-  if(oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0) {
-    return(-1);
-  }
+  OUFS_MEASURE(OUFS_OP_FWRITE);
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  return(oufs_fwritev(fp, &iov, 1));
+}
 
-  // Compute the index for the last block in the file +
-  // the first free byte within the block
-  
-  //int current_block = (fp->offset + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
-  int current_block = fp->offset / DATA_BLOCK_SIZE;
-  int used_bytes_in_last_block = fp->offset % DATA_BLOCK_SIZE;
-  int free_bytes_in_last_block = DATA_BLOCK_SIZE - used_bytes_in_last_block;
-  int len_written = 0;
-  int len_left = len;
 
-  // TODO
-  //memset(buf, 0, len);
-  if (inode.type != FILE_TYPE) {
-    fprintf(stderr, "Cannot write to directories\n");
-    return(-1);
-  }
+// A write in progress: the data block being filled is held in memory
+//  until the write moves on to another block
+typedef struct
+{
+  OUFILE *fp;
+  INODE *inode;
+  BLOCK *master;
+  int master_dirty;
 
-  if (inode.size == DATA_BLOCK_SIZE*MAX_BLOCKS_IN_FILE)
-    return 0;
+  // Indexed files: the index block must be rewritten
+  int map_dirty;
 
-  BLOCK master;
-  BLOCK bufB;
-  BLOCK_REFERENCE br;
-  //int count = 0;
-  virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master);
-  
-  if (inode.content == UNALLOCATED_BLOCK) {
-    br = oufs_allocate_new_block(&master, &block);
-    inode.content = br;
-    fp->block_reference_cache[0] = br;
-    fp->n_data_blocks++;
-    block.next_block = UNALLOCATED_BLOCK;
-    virtual_disk_write_block(br, &block);
-  }
-  else if (used_bytes_in_last_block == 0) {
-    br = oufs_allocate_new_block(&master, &block);
-    virtual_disk_read_block(fp->block_reference_cache[current_block-1], &bufB);
-    bufB.next_block = br;
-    fp->block_reference_cache[current_block] = br;
-    fp->n_data_blocks++;
-    block.next_block = UNALLOCATED_BLOCK;
-    virtual_disk_write_block(fp->block_reference_cache[current_block-1], &bufB);
-    virtual_disk_write_block(br, &block);
-  }
-  else
-    br = fp->block_reference_cache[current_block];
+  // The block being filled: its index within the file (-1 if none)
+  int index;
+  int dirty;
+  BLOCK block;
+} WRITE_STATE;
 
-  for (int i = current_block; i < MAX_BLOCKS_IN_FILE; i++) {
-    virtual_disk_read_block(br, &block);
-    used_bytes_in_last_block = fp->offset % DATA_BLOCK_SIZE;
-    free_bytes_in_last_block = DATA_BLOCK_SIZE - used_bytes_in_last_block;
+/*
+ * Write out the data block held by a write in progress (if it changed)
+ */
+static void write_state_retire(WRITE_STATE *ws)
+{
+  if(ws->index >= 0 && ws->dirty)
+    virtual_disk_write_block(ws->fp->block_reference_cache[ws->index], &ws->block);
+  ws->index = -1;
+  ws->dirty = 0;
+}
 
-    if (len_left > free_bytes_in_last_block) {
-      memcpy(block.content.data.data + used_bytes_in_last_block, buf + len_written, free_bytes_in_last_block);
-      len_left -= free_bytes_in_last_block;
-      len_written += free_bytes_in_last_block;
-      fp->offset += free_bytes_in_last_block;
-      inode.size += free_bytes_in_last_block;
-      virtual_disk_write_block(br, &block);
-    }
-    else {
-      memcpy(block.content.data.data + used_bytes_in_last_block, buf + len_written, len_left);
-      len_written += len_left;
-      fp->offset += len_left;
-      inode.size += len_left;
-      len_left = 0;
-      virtual_disk_write_block(br, &block);
-      break;
-    }
+/*
+ * Make data block i of the file the block being filled
+ * - An existing block is read in
+ * - Otherwise a new, zeroed block is allocated and hooked into the file:
+ *    chained files link the previous block to it; indexed files record it
+ *    in the block map (blocks skipped over become holes).  Blocks reserved
+ *    by oufs_fallocate() are used first; otherwise the block after the
+ *    previous one is preferred
+ *
+ * @return 0 if success
+ *         -x if the file or the disk is full, or on error
+ */
+static int write_state_load(WRITE_STATE *ws, int i)
+{
+  OUFILE *fp = ws->fp;
+  BLOCK fresh;
 
-    if (i != MAX_BLOCKS_IN_FILE - 1) {
-      br = oufs_allocate_new_block(&master, &bufB);
-      fp->block_reference_cache[i+1] = br;
-      fp->n_data_blocks++;
-      block.next_block = br;
-      virtual_disk_write_block(fp->block_reference_cache[i], &block);
-      virtual_disk_write_block(br, &bufB);
-    }
+  if(i < fp->n_data_blocks && fp->block_reference_cache[i] != UNALLOCATED_BLOCK) {
+    write_state_retire(ws);
+    if(virtual_disk_read_block(fp->block_reference_cache[i], &ws->block) != 0)
+      return(-1);
+    ws->index = i;
+    return(0);
   }
 
-  virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
-  oufs_write_inode_by_reference(fp->inode_reference, &inode);
+  if(i >= MAX_BLOCKS_IN_FILE)
+    return(-2);
+  BLOCK_REFERENCE br;
+  if(fp->next_reserved_block < fp->n_reserved_blocks) {
+    // Space set aside by oufs_fallocate()
+    br = fp->reserved_blocks[fp->next_reserved_block++];
+  }else{
+    // Try to continue the file in place
+    BLOCK_REFERENCE goal = (i > 0 && i - 1 < fp->n_data_blocks &&
+			    fp->block_reference_cache[i - 1] != UNALLOCATED_BLOCK) ?
+      fp->block_reference_cache[i - 1] + 1 : UNALLOCATED_BLOCK;
+    if(oufs_allocate_blocks(ws->master, goal, 1, &br) != 0)
+      return(-3);
+    ws->master_dirty = 1;
+  }
+  memset(&fresh, 0, BLOCK_SIZE);
+  fresh.next_block = UNALLOCATED_BLOCK;
+
+  if(ws->inode->flags & INODE_INDEXED) {
+    ws->map_dirty = 1;
+  }else if(i == 0) {
+    ws->inode->content = br;
+  }else if(ws->index == i - 1) {
+    // Link the block being filled to the new one
+    ws->block.next_block = br;
+    ws->dirty = 1;
+  }else{
+    // Link the (full) last block on the disk to the new one
+    BLOCK prev;
+    if(virtual_disk_read_block(fp->block_reference_cache[i - 1], &prev) != 0)
+      return(-1);
+    prev.next_block = br;
+    virtual_disk_write_block(fp->block_reference_cache[i - 1], &prev);
+  }
+  write_state_retire(ws);
 
-  // Done
-  return(len_written);
+  for(int j = fp->n_data_blocks; j < i; ++j)
+    fp->block_reference_cache[j] = UNALLOCATED_BLOCK;
+  fp->block_reference_cache[i] = br;
+  fp->n_data_blocks = MAX(fp->n_data_blocks, i + 1);
+  fp->n_cached_blocks = fp->n_data_blocks;
+
+  ws->block = fresh;
+  ws->index = i;
+  ws->dirty = 1;
+  return(0);
+}
+
+/*
+ * Copy bytes into the file at a given position
+ *
+ * @param ws Write in progress
+ * @param pos Byte position within the file
+ * @param src Bytes to write; NULL writes zeros
+ * @param len Number of bytes
+ * @return The number of bytes written (less than len if the file or the
+ *           disk is full)
+ */
+static int write_state_put(WRITE_STATE *ws, int pos, unsigned char *src, int len)
+{
+  int done = 0;
+
+  while(done < len) {
+    int i = (pos + done) / DATA_BLOCK_SIZE;
+    int byte_offset_in_block = (pos + done) % DATA_BLOCK_SIZE;
+    if(i != ws->index && write_state_load(ws, i) != 0)
+      break;
+
+    int n = MIN(len - done, DATA_BLOCK_SIZE - byte_offset_in_block);
+    if(src != NULL)
+      memcpy(ws->block.content.data.data + byte_offset_in_block, src + done, n);
+    else
+      memset(ws->block.content.data.data + byte_offset_in_block, 0, n);
+    ws->dirty = 1;
+    done += n;
+  }
+  return(done);
+}
+
+/*
+ * Switch a chained file over to an index block, so that it can have holes
+ * - The block map of the file must be fully loaded
+ * - The index block is allocated here and written by write_state_finish()
+ *
+ * @return 0 if success
+ *         -x if error
+ */
+static int write_state_make_indexed(WRITE_STATE *ws)
+{
+  BLOCK index_block;
+
+  if(ws->inode->flags & INODE_INDEXED)
+    return(0);
+
+  BLOCK_REFERENCE br = oufs_allocate_new_block(ws->master, &index_block);
+  if(br == UNALLOCATED_BLOCK)
+    return(-1);
+
+  ws->master_dirty = 1;
+  ws->map_dirty = 1;
+  ws->inode->flags |= INODE_INDEXED;
+  ws->inode->content = br;
+  return(0);
+}
+
+/*
+ * Complete a write in progress: write out the block being filled, the
+ * index block (if it changed) and the master block (if it changed)
+ */
+static void write_state_finish(WRITE_STATE *ws)
+{
+  write_state_retire(ws);
+
+  if(ws->map_dirty) {
+    BLOCK index_block;
+    memset(&index_block, 0, BLOCK_SIZE);
+    index_block.next_block = UNALLOCATED_BLOCK;
+    for(int i = 0; i < N_INDEX_ENTRIES_PER_BLOCK; ++i)
+      index_block.content.index.block[i] = (i < ws->fp->n_data_blocks) ?
+	ws->fp->block_reference_cache[i] : UNALLOCATED_BLOCK;
+    virtual_disk_write_block(ws->inode->content, &index_block);
+  }
+  if(ws->master_dirty)
+    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, ws->master);
+}
+
+/*
+ * Write bytes gathered from several buffers to the disk, at the offset of
+ * an open file.
+ * - The buffers are written back to back, as if they were one buffer
+ * - The inode and master block are read and written once per call, and
+ *    each data block is written once, after it has been filled
+ * - If the offset was moved past the end of the file (oufs_fseek()), the
+ *    gap reads as zeros; whole blocks in the gap become holes
+ *
+ * @param fp OUFILE pointer (must be opened for w or a)
+ * @param iov Array of buffers
+ * @param iovcnt Number of buffers
+ * @return The number of written bytes
+ *          0 if file is full and no more bytes can be written
+ *         -x if an error
+ */
+static int oufs_file_write(OUFILE *fp, const struct iovec *iov, int iovcnt)
+{
+  OUFS_TRACE_EVENT(TRACE_FWRITE, fp->inode_reference, iovcnt);
+
+  INODE inode;
+  unsigned char inline_data[OUFS_INLINE_DATA_SIZE];
+  if(oufs_read_inline_data(fp->inode_reference, &inode, inline_data) != 0) {
+    return(-1);
+  }
+  if (inode.type != FILE_TYPE) {
+    fprintf(stderr, "Cannot write to directories\n");
+    return(-1);
+  }
+
+  BLOCK master;
+  if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0) {
+    return(-1);
+  }
+
+  int len = 0;
+  for(int k = 0; k < iovcnt; ++k)
+    len += iov[k].iov_len;
+
+  // Bytes of former inline data that are written ahead of the caller's
+  //  buffers when a small file outgrows its inode slots
+  int carry = 0;
+
+  if((inode.flags & INODE_INLINE_DATA) ||
+     (inode.size == 0 && inode.content == UNALLOCATED_BLOCK)) {
+    // Does the file still fit inline?
+    if(len > 0 && fp->offset + len <= OUFS_INLINE_DATA_SIZE) {
+      // A gap past the end reads as zeros.  The offset may also be behind
+      //  the end, if another handle has appended since this one was opened
+      int pos = fp->offset;
+      if(pos > (int) inode.size)
+	memset(inline_data + inode.size, 0, pos - inode.size);
+      for(int k = 0; k < iovcnt; ++k) {
+	memcpy(inline_data + pos, iov[k].iov_base, iov[k].iov_len);
+	pos += iov[k].iov_len;
+      }
+      int size = MAX((int) inode.size, pos);
+      if(oufs_write_inline_data(&master, fp->inode_reference, &inode, inline_data, size) == 0) {
+	virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+	fp->offset += len;
+	return(len);
+      }
+      // No free slots next to the inode: use data blocks
+    }
+
+    if(inode.flags & INODE_INLINE_DATA) {
+      // Promote to data blocks: the inline bytes are rewritten from the
+      //  start of the file (master block changes are only written along
+      //  with the new blocks)
+      carry = inode.size;
+      oufs_release_inline_data(&master, &inode);
+      fp->n_data_blocks = 0;
+    }
+  }
+
+  // Data shared with a clone is copied before it is changed
+  if(!(inode.flags & (INODE_INLINE_DATA | INODE_INDEXED)) &&
+     inode.content != UNALLOCATED_BLOCK &&
+     master.content.master.block_shares[inode.content] > 0) {
+    if(oufs_unshare_blocks(&master, &inode, fp->block_reference_cache) != 0) {
+      return(-1);
+    }
+    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    oufs_write_inode_by_reference(fp->inode_reference, &inode);
+  }
+
+  WRITE_STATE ws;
+  ws.fp = fp;
+  ws.inode = &inode;
+  ws.master = &master;
+  // Promotion freed the inline slots in the master block
+  ws.master_dirty = (carry > 0);
+  ws.map_dirty = 0;
+  ws.index = -1;
+  ws.dirty = 0;
+
+  // Where the existing data ends
+  int pos = (carry > 0) ? 0 : (int) inode.size;
+  int next_reserved_block = fp->next_reserved_block;
+  if(carry > 0 && write_state_put(&ws, 0, inline_data, carry) != carry) {
+    // Not even room for the old data: leave the file as it was
+    fp->next_reserved_block = next_reserved_block;
+    return(0);
+  }
+  pos += carry;
+
+  // Fill a gap left by oufs_fseek(): zeros up to the end of the last
+  //  block, holes for whole blocks, and zeros at the start of the block
+  //  that the new data begins in
+  if(fp->offset > pos) {
+    int n_blocks = (pos + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    int gap_block = fp->offset / DATA_BLOCK_SIZE;
+    if(gap_block > n_blocks && write_state_make_indexed(&ws) != 0) {
+      return(0);
+    }
+    int n = MIN(fp->offset, n_blocks * DATA_BLOCK_SIZE) - pos;
+    if(write_state_put(&ws, pos, NULL, n) != n) {
+      write_state_finish(&ws);
+      return(0);
+    }
+    pos = MAX(pos + n, gap_block * DATA_BLOCK_SIZE);
+    n = fp->offset - pos;
+    if(n > 0 && write_state_put(&ws, pos, NULL, n) != n) {
+      write_state_finish(&ws);
+      return(0);
+    }
+    pos = fp->offset;
+  }
+
+  int len_written = 0;
+  for(int k = 0; k < iovcnt; ++k) {
+    int n = write_state_put(&ws, pos, iov[k].iov_base, iov[k].iov_len);
+    pos += n;
+    len_written += n;
+    if(n < (int) iov[k].iov_len)
+      // File or disk is full
+      break;
+  }
+
+  // Flush the block being filled, then the metadata
+  write_state_finish(&ws);
+  if(ws.master_dirty || ws.map_dirty || pos != (int) inode.size) {
+    inode.size = MAX((int) inode.size, pos);
+    oufs_write_inode_by_reference(fp->inode_reference, &inode);
+  }
+  fp->offset = pos;
+
+  // Done
+  return(len_written);
+}
+
+
+/*
+ * Write out the bytes held in the write buffer of an open file.  Blocks
+ * are allocated for all of them at once (along with room for the bytes
+ * that the caller is about to write next), so they can form one run.
+ * - If the file was removed in the meantime, the bytes are dropped (files
+ *    removed by this program lose their buffered bytes right away)
+ *
+ * @param fp OUFILE pointer (opened for w or a)
+ * @param extra Number of bytes that will be written right after these
+ * @return The number of bytes written
+ *         -x if an error
+ */
+static int oufs_file_flush(OUFILE *fp, int extra)
+{
+  INODE inode;
+  int n = fp->n_buffered;
+
+  release_promised_blocks(fp);
+  if(n == 0)
+    return(0);
+  fp->n_buffered = 0;
+  fp->offset -= n;
+
+  if(fp->inode_reference == UNALLOCATED_INODE ||
+     oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0 ||
+     inode.type != FILE_TYPE || inode.n_references == 0) {
+    // Nothing left to write to: the data never touches the disk
+    return(-1);
+  }
+
+  // Small files stay inline, and need no blocks
+  if(fp->offset + n + extra > OUFS_INLINE_DATA_SIZE)
+    oufs_fallocate(fp, n + extra);
+
+  struct iovec iov;
+  iov.iov_base = fp->write_buffer;
+  iov.iov_len = n;
+  return(oufs_file_write(fp, &iov, 1));
+}
+
+
+/*
+ * Promise enough free blocks to an open file for it to grow to end bytes
+ * once its buffer is flushed.  The blocks are only counted, not picked
+ *
+ * @param fp OUFILE pointer (opened for w or a)
+ * @param end Size that the file will have
+ * @return 0 if success
+ *         -x if there are not enough free blocks
+ */
+static int promise_blocks(OUFILE *fp, int end)
+{
+  BLOCK master;
+
+  int n_blocks = (MIN(end, MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE) + DATA_BLOCK_SIZE - 1) /
+    DATA_BLOCK_SIZE;
+  int n_new = n_blocks - fp->n_data_blocks - fp->n_reserved_blocks + fp->next_reserved_block -
+    fp->n_promised_blocks;
+  if(n_new <= 0)
+    return(0);
+
+  if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return(-1);
+  if(master.content.master.n_free_blocks - n_promised_blocks < n_new) {
+    OUFS_TRACE_EVENT(TRACE_NO_BLOCKS, n_new, 0);
+    return(-2);
+  }
+  fp->n_promised_blocks += n_new;
+  n_promised_blocks += n_new;
+  return(0);
+}
+
+
+/*
+ * Write bytes gathered from several buffers to an open file.
+ * - The buffers are written back to back, as if they were one buffer
+ * - Bytes are collected in the file's write buffer, and only go to the
+ *    disk (and get blocks) when the buffer fills up, on oufs_fflush() or
+ *    on oufs_fclose().  Enough free blocks for them are promised right
+ *    away.  Writes larger than the buffer, or for which there are not
+ *    enough free blocks, go straight through
+ * - Otherwise behaves like oufs_fwrite()
+ *
+ * @param fp OUFILE pointer (must be opened for w or a)
+ * @param iov Array of buffers
+ * @param iovcnt Number of buffers
+ * @return The number of written bytes
+ *          0 if file is full and no more bytes can be written
+ *         -x if an error
+ */
+int oufs_fwritev(OUFILE *fp, const struct iovec *iov, int iovcnt)
+{
+  OUFS_MEASURE(OUFS_OP_FWRITEV);
+  if(fp->mode == 'r') {
+    fprintf(stderr, "Can't write to read-only file");
+    return(0);
+  }
+  if(fp->inode_reference == UNALLOCATED_INODE) {
+    // The file was removed
+    return(0);
+  }
+  int len = 0;
+  for(int k = 0; k < iovcnt; ++k)
+    len += iov[k].iov_len;
+
+  if(fp->n_buffered + len > OUFS_WRITE_BUFFER_SIZE) {
+    // Make room (and reserve blocks for this write as well)
+    int n = fp->n_buffered;
+    if(n > 0 && oufs_file_flush(fp, len) != n)
+      return(0);
+  }
+
+  if(len > OUFS_WRITE_BUFFER_SIZE ||
+     (fp->write_buffer == NULL &&
+      (fp->write_buffer = (unsigned char *) malloc(OUFS_WRITE_BUFFER_SIZE)) == NULL) ||
+     promise_blocks(fp, fp->offset + len) != 0) {
+    // Straight to the disk.  So are bytes that could not be sure of getting
+    //  blocks later: the count returned is then what was really written
+    int n = fp->n_buffered;
+    if(n > 0 && oufs_file_flush(fp, len) != n)
+      return(0);
+    if(fp->offset + len > OUFS_INLINE_DATA_SIZE)
+      oufs_fallocate(fp, len);
+    return(oufs_file_write(fp, iov, iovcnt));
+  }
+
+  // Buffer what fits in the file
+  len = MIN(len, MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE - fp->offset);
+  int done = 0;
+  for(int k = 0; k < iovcnt && done < len; ++k) {
+    int n = MIN((int) iov[k].iov_len, len - done);
+    memcpy(fp->write_buffer + fp->n_buffered + done, iov[k].iov_base, n);
+    done += n;
+  }
+  fp->n_buffered += done;
+  fp->offset += done;
+
+  return(done);
+}
+
+
+/**
+ * Write out the bytes buffered for an open file
+ *
+ * @param fp OUFILE pointer
+ * @return 0 if success
+ *         -x if not all of the bytes could be written
+ */
+int oufs_fflush(OUFILE *fp)
+{
+  OUFS_MEASURE(OUFS_OP_FFLUSH);
+  int n = fp->n_buffered;
+  return((oufs_file_flush(fp, 0) == n) ? 0 : -1);
+}
+
+
+// What a hole in a sparse file reads as
+static unsigned char hole_data[DATA_BLOCK_SIZE];
+
+/*
+ * Find the block reference for one of the data blocks of an open file.
+ * - Blocks that are not yet in the block map are found by following the
+ *    next_block links from the last known block (and are then cached)
+ *
+ * @param fp OUFILE pointer
+ * @param index Index of the data block within the file (0, 1, ...)
+ * @return The reference of the requested block
+ *         UNALLOCATED_BLOCK if the block does not exist or cannot be read
+ */
+static BLOCK_REFERENCE oufs_file_block_reference(OUFILE *fp, int index)
+{
+  BLOCK block;
+
+  if(index < 0 || index >= fp->n_data_blocks || fp->n_cached_blocks == 0)
+    return(UNALLOCATED_BLOCK);
+
+  while(fp->n_cached_blocks <= index) {
+    BLOCK_REFERENCE br = fp->block_reference_cache[fp->n_cached_blocks - 1];
+    if(br == UNALLOCATED_BLOCK || virtual_disk_read_block(br, &block) != 0)
+      return(UNALLOCATED_BLOCK);
+    fp->block_reference_cache[fp->n_cached_blocks++] = block.next_block;
+  }
+
+  return(fp->block_reference_cache[index]);
+}
+
+
+/*
+ * Record the successor of a data block that has just been read, extending
+ * the block map one step ahead of the data (so the chain is never walked
+ * twice).
+ *
+ * @param fp OUFILE pointer
+ * @param index Index of the data block within the file
+ * @param block The contents of that data block
+ */
+static void oufs_file_note_successor(OUFILE *fp, int index, BLOCK *block)
+{
+  if(index + 1 == fp->n_cached_blocks && index + 1 < fp->n_data_blocks)
+    fp->block_reference_cache[fp->n_cached_blocks++] = block->next_block;
+}
+
+
+/*
+ * Adjust the readahead window at the start of a read: grow it while reads
+ * are sequential and back off as soon as the caller jumps around.
+ *
+ * @param fp OUFILE pointer (opened for r)
+ */
+static void oufs_file_update_readahead(OUFILE *fp)
+{
+  if(fp->offset == fp->readahead_offset)
+    fp->readahead_blocks = (fp->readahead_blocks == 0) ? OUFS_READAHEAD_MIN :
+      MIN(fp->readahead_blocks * 2, OUFS_READAHEAD_MAX);
+  else
+    fp->readahead_blocks = 0;
+}
+
+
+/*
+ * Prefetch the blocks that follow a data block of a file that is being
+ * read sequentially.
+ * - The next readahead_blocks physical blocks (or as many as the current
+ *    request spans, if that is more) are pulled into the block cache with
+ *    one disk request, on the bet that the chain is contiguous
+ * - The chain is then followed through the prefetched run to extend the
+ *    block map; if it leaves the run early, the window is halved
+ *
+ * @param fp OUFILE pointer (opened for r)
+ * @param index Index of the data block about to be read
+ * @param n_wanted Number of blocks (starting at index) the caller needs
+ */
+static void oufs_file_readahead(OUFILE *fp, int index, int n_wanted)
+{
+  BLOCK block;
+  BLOCK_REFERENCE br = oufs_file_block_reference(fp, index);
+  int n = MIN(MIN(MAX(fp->readahead_blocks, n_wanted), OUFS_READAHEAD_MAX),
+	      fp->n_data_blocks - index);
+
+  if(n < OUFS_READAHEAD_MIN || br == UNALLOCATED_BLOCK ||
+     virtual_disk_block_is_cached(br))
+    return;
+
+  if((n = virtual_disk_prefetch_blocks(br, n)) <= 0)
+    return;
+
+  // Walk the block map while it stays inside the prefetched run (chained
+  //  files: following the chain where it is not yet known)
+  int used = 1;
+  while(used < n && index + used < fp->n_data_blocks) {
+    if(index + used == fp->n_cached_blocks) {
+      if(virtual_disk_read_block(fp->block_reference_cache[index + used - 1], &block) != 0)
+	break;
+      fp->block_reference_cache[fp->n_cached_blocks++] = block.next_block;
+    }
+    if(fp->block_reference_cache[index + used] != br + used)
+      break;
+    ++used;
+  }
+
+  // Fragmented chain: be less speculative next time
+  if(used < n)
+    fp->readahead_blocks = MAX(fp->readahead_blocks / 2, OUFS_READAHEAD_MIN);
 }
 
 
@@ -691,60 +1454,548 @@ int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len)
 
 int oufs_fread(OUFILE *fp, unsigned char * buf, int len)
 {
+  OUFS_MEASURE(OUFS_OP_FREAD);
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  return(oufs_freadv(fp, &iov, 1));
+}
+
+
+/*
+ * Read a sequence of bytes from an open file, scattering them across
+ * several buffers.
+ * - The buffers are filled in order, as if they were one buffer
+ * - The inode is read once per call, and each data block is read once
+ * - Otherwise behaves like oufs_fread()
+ *
+ * @param fp OUFILE pointer (must be opened for r)
+ * @param iov Array of buffers
+ * @param iovcnt Number of buffers
+ * @return The number of bytes read
+ *         0 if offset is at size
+ *         -x if an error
+ */
+int oufs_freadv(OUFILE *fp, const struct iovec *iov, int iovcnt)
+{
+  OUFS_MEASURE(OUFS_OP_FREADV);
   // Check open mode
   if(fp->mode != 'r') {
     fprintf(stderr, "Can't read from a write-only file");
     return(0);
   }
-  if(debug)
-    fprintf(stderr, "\n-------\noufs_fread(%d)\n", len);
-    
+  OUFS_TRACE_EVENT(TRACE_FREAD, fp->inode_reference, iovcnt);
+
   INODE inode;
   BLOCK block;
-  if(oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0) {
+  unsigned char inline_data[OUFS_INLINE_DATA_SIZE];
+  if(oufs_read_inline_data(fp->inode_reference, &inode, inline_data) != 0) {
     return(-1);
   }
-      
-  // Compute the current block and offset within the block
-  int current_block = fp->offset / DATA_BLOCK_SIZE;
-  int byte_offset_in_block = fp->offset % DATA_BLOCK_SIZE;
+  if (inode.type != FILE_TYPE)
+    return -1;
+
+  // Total space offered by the caller, limited by the end of the file
+  int len = 0;
+  for(int k = 0; k < iovcnt; ++k)
+    len += iov[k].iov_len;
+  int len_left = MIN(len, (int) inode.size - fp->offset);
   int len_read = 0;
-  int end_of_file = inode.size;
-  len = MIN(len, end_of_file - fp->offset);
-  int len_left = len;
 
-  // TODO
-  int buffSize = sizeof(buf);
-  memset(buf, 0, buffSize);
   //If there is no more data
-  if (inode.type != FILE_TYPE)
-    return -1;
-  if (fp->offset == inode.size)
+  if (len_left <= 0)
     return 0;
 
-  for (int i = current_block; i < fp->n_data_blocks; i++) {
-    virtual_disk_read_block(fp->block_reference_cache[i], &block);
-    if (len_left / (DATA_BLOCK_SIZE - byte_offset_in_block) >= 1) {
-      memcpy(buf + len_read, block.content.data.data + byte_offset_in_block, DATA_BLOCK_SIZE - byte_offset_in_block);
-      len_read += DATA_BLOCK_SIZE - byte_offset_in_block;
-      fp->offset += (DATA_BLOCK_SIZE - byte_offset_in_block);
-      len_left -= DATA_BLOCK_SIZE - byte_offset_in_block;
-    }
-    else {
-      memcpy(buf + len_read, block.content.data.data + byte_offset_in_block, len_left);
-      len_read += len_left;
-      fp->offset += len_left;
-      break;
+  oufs_file_update_readahead(fp);
+
+  // Position within the caller's buffers
+  int k = 0;
+  int pos = 0;
+
+  while(len_left > 0) {
+    unsigned char *src;
+    int n;
+
+    if(inode.flags & INODE_INLINE_DATA) {
+      // Small file: the data came along with the inode
+      src = inline_data + fp->offset;
+      n = len_left;
+    }else{
+      // Compute the current block and offset within the block
+      int i = fp->offset / DATA_BLOCK_SIZE;
+      int byte_offset_in_block = fp->offset % DATA_BLOCK_SIZE;
+
+      oufs_file_readahead(fp, i, (byte_offset_in_block + len_left + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE);
+      BLOCK_REFERENCE br = oufs_file_block_reference(fp, i);
+      if(br == UNALLOCATED_BLOCK && (inode.flags & INODE_INDEXED)) {
+	// Hole
+	src = hole_data + byte_offset_in_block;
+      }else{
+	if(br == UNALLOCATED_BLOCK || virtual_disk_read_block(br, &block) != 0)
+	  return(-1);
+	oufs_file_note_successor(fp, i, &block);
+	src = block.content.data.data + byte_offset_in_block;
+      }
+      n = MIN(len_left, DATA_BLOCK_SIZE - byte_offset_in_block);
     }
 
-    byte_offset_in_block = (fp->offset % DATA_BLOCK_SIZE);
-
+    // Scatter these bytes across the buffers
+    while(n > 0) {
+      while(pos == (int) iov[k].iov_len) {
+	++k;
+	pos = 0;
+      }
+      int m = MIN(n, (int) iov[k].iov_len - pos);
+      memcpy((unsigned char *) iov[k].iov_base + pos, src, m);
+      pos += m;
+      src += m;
+      n -= m;
+      len_read += m;
+      len_left -= m;
+      fp->offset += m;
+    }
   }
+  fp->readahead_offset = fp->offset;
+
   // Done
   return(len_read);
 }
 
 
+/*
+ * Read a sequence of bytes from an open file without copying them.
+ * - Instead of filling a buffer, each element of iov is pointed at the
+ *    payload of one cached data block (one element per block touched)
+ * - The blocks stay pinned in the block cache until they are handed back
+ *    to oufs_release_views(); this must happen before the disk is detached
+ * - Holes in a sparse file are returned as views of a shared block of
+ *    zeros
+ * - offset is advanced past the returned bytes
+ *
+ * @param fp OUFILE pointer (must be opened for r)
+ * @param iov Array of views to fill in
+ * @param iovcnt Maximum number of views to return
+ * @param len Number of bytes to read at max
+ * @return The number of views filled in (the sum of their lengths is the
+ *           number of bytes read)
+ *         0 if offset is at size
+ *         -x if an error
+ */
+int oufs_fread_views(OUFILE *fp, struct iovec *iov, int iovcnt, int len)
+{
+  OUFS_MEASURE(OUFS_OP_FREAD_VIEWS);
+  // Check open mode
+  if(fp->mode != 'r') {
+    fprintf(stderr, "Can't read from a write-only file");
+    return(0);
+  }
+  OUFS_TRACE_EVENT(TRACE_FREAD_VIEWS, fp->inode_reference, len);
+
+  INODE inode;
+  if(oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0) {
+    return(-1);
+  }
+  if(inode.type != FILE_TYPE)
+    return(-1);
+
+  int len_left = MIN(len, (int) inode.size - fp->offset);
+  int n_views = 0;
+
+  if(len_left <= 0)
+    return(0);
+
+  if(inode.flags & INODE_INLINE_DATA) {
+    // Small file: one view into the inode block
+    BLOCK *block;
+    if(iovcnt < 1 ||
+       (block = virtual_disk_pin_block(fp->inode_reference / N_INODES_PER_BLOCK + 1)) == NULL)
+      return(-1);
+    iov[0].iov_base = (unsigned char *) &block->content.inodes.inode[inode.content % N_INODES_PER_BLOCK]
+      + fp->offset;
+    iov[0].iov_len = len_left;
+    fp->offset += len_left;
+    return(1);
+  }
+
+  oufs_file_update_readahead(fp);
+
+  while(len_left > 0 && n_views < iovcnt) {
+    int i = fp->offset / DATA_BLOCK_SIZE;
+    int byte_offset_in_block = fp->offset % DATA_BLOCK_SIZE;
+
+    oufs_file_readahead(fp, i, MIN(iovcnt - n_views,
+				   (byte_offset_in_block + len_left + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE));
+    BLOCK_REFERENCE br = oufs_file_block_reference(fp, i);
+    unsigned char *data;
+    if(br == UNALLOCATED_BLOCK && (inode.flags & INODE_INDEXED)) {
+      // Hole: a view of zeros (not pinned)
+      data = hole_data;
+    }else{
+      BLOCK *block;
+      if(br == UNALLOCATED_BLOCK || (block = virtual_disk_pin_block(br)) == NULL)
+	// Out of cache slots: hand back what we have so far
+	break;
+      oufs_file_note_successor(fp, i, block);
+      data = block->content.data.data;
+    }
+
+    int n = MIN(len_left, DATA_BLOCK_SIZE - byte_offset_in_block);
+    iov[n_views].iov_base = data + byte_offset_in_block;
+    iov[n_views].iov_len = n;
+    ++n_views;
+
+    fp->offset += n;
+    len_left -= n;
+  }
+  fp->readahead_offset = fp->offset;
+
+  if(n_views == 0)
+    // Could not pin even a single block
+    return(-1);
+
+  return(n_views);
+}
+
+
+/*
+ * Release views returned by oufs_fread_views()
+ *
+ * @param iov Array of views
+ * @param iovcnt Number of views in the array
+ */
+void oufs_release_views(struct iovec *iov, int iovcnt)
+{
+  OUFS_MEASURE(OUFS_OP_RELEASE_VIEWS);
+  for(int i = 0; i < iovcnt; ++i)
+    virtual_disk_unpin_block(iov[i].iov_base);
+}
+
+
+/**
+ * Move the offset of an open file
+ * - mode = "r": the offset can be anywhere from 0 to the size of the file
+ * - mode = "w" or "a": the offset can only move forward.  Moving it past
+ *    the end of the file leaves a gap, which is filled in by the next
+ *    write: the gap reads as zeros, and whole blocks in it are left as
+ *    holes that take no space on the disk
+ *
+ * @param fp OUFILE pointer
+ * @param offset New offset from the start of the file
+ * @return 0 if success
+ *         -x if the offset is out of range
+ */
+int oufs_fseek(OUFILE *fp, int offset)
+{
+  OUFS_MEASURE(OUFS_OP_FSEEK);
+  INODE inode;
+
+  if(oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0) {
+    return(-1);
+  }
+
+  if(fp->mode == 'r') {
+    if(offset < 0 || offset > (int) inode.size)
+      return(-2);
+  }else{
+    if(offset < fp->offset || offset > MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE)
+      return(-3);
+    // The gap is filled in on the disk
+    if(offset > fp->offset && oufs_fflush(fp) != 0)
+      return(-4);
+  }
+
+  fp->offset = offset;
+  return(0);
+}
+
+
+/**
+ * Punch a hole in a file: the given range reads as zeros afterwards, and
+ * the data blocks that lie entirely inside it are returned to the free list
+ * - The size of the file does not change
+ * - The freed blocks are also discarded on the host
+ * - A file that shares its blocks with a clone gets its own copy first
+ * - A file that was not already sparse gets an index block the first time
+ *    a block is freed
+ * - Partially covered blocks are zeroed in place
+ *
+ * @param fp OUFILE pointer (must be opened for w or a)
+ * @param offset Start of the range
+ * @param len Number of bytes in the range
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_fpunch(OUFILE *fp, int offset, int len)
+{
+  OUFS_MEASURE(OUFS_OP_FPUNCH);
+  if(fp->mode == 'r') {
+    fprintf(stderr, "Can't write to read-only file");
+    return(-1);
+  }
+
+  if(fp->inode_reference == UNALLOCATED_INODE || oufs_fflush(fp) != 0) {
+    return(-1);
+  }
+
+  INODE inode;
+  unsigned char inline_data[OUFS_INLINE_DATA_SIZE];
+  BLOCK master;
+  if(oufs_read_inline_data(fp->inode_reference, &inode, inline_data) != 0 ||
+     virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0) {
+    return(-1);
+  }
+  if(inode.type != FILE_TYPE || offset < 0 || len < 0) {
+    return(-2);
+  }
+
+  int end = MIN(offset + len, (int) inode.size);
+  if(offset >= end)
+    return(0);
+
+  if(inode.flags & INODE_INLINE_DATA) {
+    // Small file: rewrite the data in place
+    memset(inline_data + offset, 0, end - offset);
+    if(oufs_write_inline_data(&master, fp->inode_reference, &inode, inline_data, inode.size) != 0) {
+      return(-1);
+    }
+    // The slots may have moved
+    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    return(0);
+  }
+
+  // Blocks that lie entirely inside the range (the last block counts if
+  //  the range runs to the end of the file)
+  int first = (offset + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+  int last = (end == (int) inode.size) ? (end + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE :
+    end / DATA_BLOCK_SIZE;
+
+  if(!(inode.flags & INODE_INDEXED) &&
+     master.content.master.block_shares[inode.content] > 0) {
+    if(oufs_unshare_blocks(&master, &inode, fp->block_reference_cache) != 0) {
+      return(-3);
+    }
+    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    oufs_write_inode_by_reference(fp->inode_reference, &inode);
+  }
+
+  int n_data_blocks = oufs_load_block_map(&inode, fp->block_reference_cache);
+  if(n_data_blocks < 0) {
+    return(-4);
+  }
+  fp->n_data_blocks = fp->n_cached_blocks = n_data_blocks;
+
+  WRITE_STATE ws;
+  ws.fp = fp;
+  ws.inode = &inode;
+  ws.master = &master;
+  ws.master_dirty = 0;
+  ws.map_dirty = 0;
+  ws.index = -1;
+  ws.dirty = 0;
+
+  // Blocks to discard on the host once they are free on the disk
+  BLOCK_REFERENCE freed[MAX_BLOCKS_IN_FILE];
+  int n_freed = 0;
+
+  if(first < last) {
+    if(write_state_make_indexed(&ws) != 0) {
+      return(-5);
+    }
+    for(int i = first; i < last; ++i) {
+      if(fp->block_reference_cache[i] != UNALLOCATED_BLOCK) {
+	oufs_deallocate_block(&master, fp->block_reference_cache[i]);
+	freed[n_freed++] = fp->block_reference_cache[i];
+	fp->block_reference_cache[i] = UNALLOCATED_BLOCK;
+	ws.master_dirty = 1;
+	ws.map_dirty = 1;
+      }
+    }
+  }
+
+  // Zero the partially covered blocks at either edge (unless they are
+  //  holes already)
+  int head_end = MIN(end, first * DATA_BLOCK_SIZE);
+  if(offset < head_end && fp->block_reference_cache[offset / DATA_BLOCK_SIZE] != UNALLOCATED_BLOCK)
+    write_state_put(&ws, offset, NULL, head_end - offset);
+  int tail_start = MAX(head_end, last * DATA_BLOCK_SIZE);
+  if(tail_start < end && fp->block_reference_cache[tail_start / DATA_BLOCK_SIZE] != UNALLOCATED_BLOCK)
+    write_state_put(&ws, tail_start, NULL, end - tail_start);
+
+  write_state_finish(&ws);
+  oufs_write_inode_by_reference(fp->inode_reference, &inode);
+  oufs_discard_blocks(freed, n_freed);
+
+  return(0);
+}
+
+
+/**
+ * Copy a file within the disk
+ * - The source must be a file; the destination is created or truncated
+ *    (as by oufs_fopen() with mode "w") and must not be the source
+ * - clone = 0: the data blocks are copied block to block, reading and
+ *    writing runs of consecutive blocks
+ * - clone = 1: the destination shares the source's data blocks (each
+ *    block's share count is incremented); whichever file is written to
+ *    first gets its own copy at that point.  Sparse files are copied
+ *    instead
+ *
+ * @param cwd Absolute path for the current working directory
+ * @param path_src Absolute or relative path of the file to copy
+ * @param path_dst Absolute or relative path of the copy
+ * @param clone 1 to share data blocks; 0 to copy them
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_copy_file(char *cwd, char *path_src, char *path_dst, int clone)
+{
+  OUFS_MEASURE(OUFS_OP_COPY_FILE);
+  INODE_REFERENCE parent_src;
+  INODE_REFERENCE child_src;
+  INODE_REFERENCE parent_dst;
+  INODE_REFERENCE child_dst;
+  char local_name[MAX_PATH_LENGTH];
+  INODE inode_src;
+  INODE inode_dst;
+  BLOCK master;
+  unsigned char inline_data[OUFS_INLINE_DATA_SIZE];
+
+  // Try to find the inodes
+  if(oufs_find_file(cwd, path_src, &parent_src, &child_src, local_name) < -1) {
+    return(-5);
+  }
+  if(oufs_find_file(cwd, path_dst, &parent_dst, &child_dst, local_name) < -1) {
+    return(-6);
+  }
+
+  // SRC must be an existing file
+  if(child_src == UNALLOCATED_INODE ||
+     oufs_read_inline_data(child_src, &inode_src, inline_data) != 0 ||
+     inode_src.type != FILE_TYPE) {
+    fprintf(stderr, "Source not found\n");
+    return(-1);
+  }
+
+  // DST may only exist as another file
+  if(child_dst == child_src) {
+    fprintf(stderr, "Source and destination are the same file.\n");
+    return(-2);
+  }
+  if(child_dst != UNALLOCATED_INODE) {
+    if(oufs_read_inode_by_reference(child_dst, &inode_dst) != 0 ||
+       inode_dst.type != FILE_TYPE) {
+      fprintf(stderr, "Destination is not a file.\n");
+      return(-3);
+    }
+  }
+
+  // Create / truncate the destination
+  OUFILE *fp = oufs_fopen(cwd, path_dst, "w");
+  if(fp == NULL) {
+    return(-4);
+  }
+  child_dst = fp->inode_reference;
+
+  if(inode_src.flags & INODE_INLINE_DATA) {
+    // Small file: just write the bytes (they are never shared)
+    int ret = oufs_fwrite(fp, inline_data, inode_src.size);
+    oufs_fclose(fp);
+    return((ret == (int) inode_src.size) ? 0 : -11);
+  }
+  oufs_fclose(fp);
+
+  if(oufs_read_inode_by_reference(child_dst, &inode_dst) != 0 ||
+     virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0) {
+    return(-7);
+  }
+
+  BLOCK_REFERENCE src_refs[MAX_BLOCKS_IN_FILE];
+  int n_data_blocks = oufs_load_block_map(&inode_src, src_refs);
+  if(n_data_blocks < 0) {
+    return(-9);
+  }
+  if(n_data_blocks > 0) {
+    BLOCK_REFERENCE refs[MAX_BLOCKS_IN_FILE];
+
+    if(clone && !(inode_src.flags & INODE_INDEXED)) {
+      // Share the source's chain
+      if(master.content.master.block_shares[inode_src.content] == UCHAR_MAX) {
+	fprintf(stderr, "Too many clones.\n");
+	return(-8);
+      }
+      for(int i = 0; i < n_data_blocks; ++i)
+	++master.content.master.block_shares[src_refs[i]];
+      inode_dst.content = inode_src.content;
+    }else{
+      // Copy the source's blocks (a sparse file is always copied, holes
+      //  and all, along with a new index block)
+      if(oufs_copy_blocks(&master, src_refs, n_data_blocks, refs) != 0) {
+	return(-10);
+      }
+      if(inode_src.flags & INODE_INDEXED) {
+	BLOCK index_block;
+	BLOCK_REFERENCE br = oufs_allocate_new_block(&master, &index_block);
+	if(br == UNALLOCATED_BLOCK) {
+	  return(-10);
+	}
+	memset(&index_block, 0, BLOCK_SIZE);
+	index_block.next_block = UNALLOCATED_BLOCK;
+	for(int i = 0; i < N_INDEX_ENTRIES_PER_BLOCK; ++i)
+	  index_block.content.index.block[i] = (i < n_data_blocks) ? refs[i] : UNALLOCATED_BLOCK;
+	virtual_disk_write_block(br, &index_block);
+	inode_dst.flags |= INODE_INDEXED;
+	inode_dst.content = br;
+      }else{
+	inode_dst.content = refs[0];
+      }
+    }
+    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+  }
+
+  inode_dst.size = inode_src.size;
+  oufs_write_inode_by_reference(child_dst, &inode_dst);
+
+  // Success
+  return(0);
+}
+
+
+/**
+ * Drop one of the references to a file inode whose directory entry has
+ *   been removed, and deallocate the contents and the inode if it was the last
+ *
+ * @param child Reference to the file inode
+ * @param inode The file inode
+ */
+static void drop_reference(INODE_REFERENCE child, INODE *inode)
+{
+  inode->n_references--;
+
+  if (inode->n_references == 0) {
+    // Open files lose their buffered bytes: the inode may be reused
+    for(OUFILE *fp = open_files; fp != NULL; fp = fp->next_open) {
+      if(fp->mode != 'r' && fp->inode_reference == child) {
+	release_promised_blocks(fp);
+	fp->n_buffered = 0;
+	fp->inode_reference = UNALLOCATED_INODE;
+      }
+    }
+
+    //Modify master inode flag table
+    BLOCK master;
+    oufs_deallocate_blocks(inode);
+    virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master);
+    oufs_mark_inode(&master, child, 0);
+    memset(inode, 0, sizeof(INODE));
+    inode->content = UNALLOCATED_INODE;
+    oufs_write_inode_by_reference(child, inode);
+    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+  }
+  else
+    oufs_write_inode_by_reference(child, inode);
+}
+
+
 /**
  * Remove a file
  *
@@ -762,12 +2013,12 @@ int oufs_fread(OUFILE *fp, unsigned char * buf, int len)
 
 int oufs_remove(char *cwd, char *path)
 {
+  OUFS_MEASURE(OUFS_OP_REMOVE);
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
   char local_name[MAX_PATH_LENGTH];
   INODE inode;
-  INODE inode_parent;
-  BLOCK block;
+  OUDIR dir;
 
   // Try to find the inode of the child
   if(oufs_find_file(cwd, path, &parent, &child, local_name) < -1) {
@@ -788,45 +2039,17 @@ int oufs_remove(char *cwd, char *path)
     // Not a file
     fprintf(stderr, "Not a file\n");
     return(-2);
-  }
-
-  // TODO
-  oufs_read_inode_by_reference(parent, &inode_parent);
-  virtual_disk_read_block(inode_parent.content, &block);
-
-  for (int i = 0; i < N_DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-    if (block.content.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-      if (block.content.directory.entry[i].inode_reference == child) {
-        DIRECTORY_ENTRY dirEn;
-        memset(&dirEn, 0, sizeof(DIRECTORY_ENTRY));
-        dirEn.inode_reference = UNALLOCATED_INODE;
-        block.content.directory.entry[i] = dirEn;
-        break;
-      }
-    }
-  }
-  inode_parent.size--;
-  virtual_disk_write_block(inode_parent.content, &block);
-  oufs_write_inode_by_reference(parent, &inode_parent);
-
-  inode.n_references--;
-
-  //oufs_deallocate_blocks(&inode);
+  }
 
-  if (inode.n_references == 0) {
-    //Modify master inode flag table
-    BLOCK master;
-    oufs_deallocate_blocks(&inode);
-    virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master);
-    master.content.master.inode_allocated_flag[child/8] -= (1 << (7 - child%8));
-    memset(&inode, 0, sizeof(INODE));
-    inode.content = UNALLOCATED_INODE;
-    oufs_write_inode_by_reference(child, &inode);
-    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+  // TODO
+  // Remove this name: other links to the inode stay in place
+  if (oufs_directory_load(parent, NULL, &dir) != 0 ||
+      oufs_directory_remove(&dir, local_name) != 0 ||
+      oufs_directory_write(&dir) != 0) {
+    return(-5);
   }
-  else
-    oufs_write_inode_by_reference(child, &inode);
-  
+
+  drop_reference(child, &inode);
   
   // Success
   return(0);
@@ -849,6 +2072,7 @@ int oufs_remove(char *cwd, char *path)
  */
 int oufs_link(char *cwd, char *path_src, char *path_dst)
 {
+  OUFS_MEASURE(OUFS_OP_LINK);
   INODE_REFERENCE parent_src;
   INODE_REFERENCE child_src;
   INODE_REFERENCE parent_dst;
@@ -857,7 +2081,7 @@ int oufs_link(char *cwd, char *path_src, char *path_dst)
   char local_name_bogus[MAX_PATH_LENGTH];
   INODE inode_src;
   INODE inode_dst;
-  BLOCK block;
+  OUDIR dir;
 
   // Try to find the inodes
   if(oufs_find_file(cwd, path_src, &parent_src, &child_src, local_name_bogus) < -1) {
@@ -899,25 +2123,737 @@ int oufs_link(char *cwd, char *path_src, char *path_dst)
 
 
   // TODO
-  BLOCK p;
-
-  virtual_disk_read_block(parent_src, &p);
-  
   oufs_read_inode_by_reference(child_src, &inode_src);
+
+  if(oufs_directory_load(parent_dst, &inode_dst, &dir) != 0 ||
+     oufs_directory_insert(&dir, local_name, child_src, inode_src.type) < 0 ||
+     oufs_directory_write(&dir) != 0) {
+    fprintf(stderr, "Cannot add %s to the destination parent.\n", local_name);
+    return(-8);
+  }
+
   inode_src.n_references++;
   oufs_write_inode_by_reference(child_src, &inode_src);
+  return(0);
+}
+
+
+/**
+ * Is a directory the same as, or inside, another directory?
+ *
+ * @param dir Inode reference of the directory to test
+ * @param ancestor Inode reference of the possible ancestor
+ * @return 1 if dir is ancestor or one of its subdirectories
+ *         0 if not
+ *         -x if error
+ */
+static int directory_is_within(INODE_REFERENCE dir, INODE_REFERENCE ancestor)
+{
+  OUDIR d;
+  int i;
+
+  // Walk up the .. entries: there cannot be more steps than inodes
+  for(int steps = 0; steps < N_INODES; ++steps) {
+    if(dir == ancestor)
+      return(1);
+    if(dir == ROOT_DIRECTORY_INODE)
+      return(0);
+    if(oufs_directory_load(dir, NULL, &d) != 0 || (i = oufs_directory_lookup(&d, "..")) < 0)
+      return(-1);
+    dir = d.block.content.directory.entry[i].inode_reference;
+  }
+  return(-2);
+}
+
+
+/**
+ * Rename a file or directory, possibly moving it to another directory
+ *
+ * - An existing destination file is replaced by a source file (as with
+ *    rename(2)); any other existing destination is an error
+ * - A directory cannot be moved into itself or one of its subdirectories
+ * - No data blocks are touched.  Within one directory, the rename is a
+ *    single write of the directory block.  Across directories, the new entry
+ *    is written before the old one is removed, and a file counts both
+ *    names in between: an interrupted move can leave the file with an
+ *    extra name, but never without one
+ *
+ * @param cwd Absolute path for the current working directory
+ * @param path_src Absolute or relative path of the existing file or directory
+ * @param path_dst Absolute or relative path of its new name
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_rename(char *cwd, char *path_src, char *path_dst)
+{
+  OUFS_MEASURE(OUFS_OP_RENAME);
+  INODE_REFERENCE parent_src;
+  INODE_REFERENCE child_src;
+  INODE_REFERENCE parent_dst;
+  INODE_REFERENCE child_dst;
+  char local_src[MAX_PATH_LENGTH];
+  char local_dst[MAX_PATH_LENGTH];
+  INODE inode_src;
+  INODE inode_dst;
+  OUDIR dir_src;
+  OUDIR dir_dst;
+
+  // Try to find the inodes
+  if(oufs_find_file(cwd, path_src, &parent_src, &child_src, local_src) != 0 ||
+     child_src == UNALLOCATED_INODE) {
+    fprintf(stderr, "Source not found\n");
+    return(-1);
+  }
+  if(oufs_find_file(cwd, path_dst, &parent_dst, &child_dst, local_dst) != 0 ||
+     parent_dst == UNALLOCATED_INODE) {
+    fprintf(stderr, "Destination parent does not exist.\n");
+    return(-2);
+  }
+  if(child_src == ROOT_DIRECTORY_INODE || strcmp(local_src, ".") == 0 ||
+     strcmp(local_src, "..") == 0) {
+    fprintf(stderr, "Cannot move . , .. or /\n");
+    return(-3);
+  }
+  if(oufs_read_inode_by_reference(child_src, &inode_src) != 0) {
+    return(-4);
+  }
+
+  // An existing destination must be a file that a file replaces
+  if(child_dst != UNALLOCATED_INODE) {
+    if(child_dst == child_src) {
+      // Two names for the same file: nothing to do
+      return(0);
+    }
+    if(oufs_read_inode_by_reference(child_dst, &inode_dst) != 0) {
+      return(-4);
+    }
+    if(inode_src.type != FILE_TYPE || inode_dst.type != FILE_TYPE) {
+      fprintf(stderr, "Destination already exists.\n");
+      return(-5);
+    }
+  }
+
+  if(inode_src.type == DIRECTORY_TYPE && directory_is_within(parent_dst, child_src) != 0) {
+    fprintf(stderr, "Cannot move a directory into itself.\n");
+    return(-6);
+  }
+
+  if(oufs_directory_load(parent_src, NULL, &dir_src) != 0) {
+    return(-7);
+  }
+
+  if(parent_src == parent_dst) {
+    // One directory: both names change in the same block write
+    if(oufs_directory_remove(&dir_src, local_src) != 0 ||
+       (child_dst != UNALLOCATED_INODE && oufs_directory_remove(&dir_src, local_dst) != 0) ||
+       oufs_directory_insert(&dir_src, local_dst, child_src, inode_src.type) < 0 ||
+       oufs_directory_write(&dir_src) != 0) {
+      return(-8);
+    }
+  }else{
+    // Prepare the new entry completely before writing anything
+    if(oufs_directory_load(parent_dst, NULL, &dir_dst) != 0 ||
+       (child_dst != UNALLOCATED_INODE && oufs_directory_remove(&dir_dst, local_dst) != 0) ||
+       oufs_directory_insert(&dir_dst, local_dst, child_src, inode_src.type) < 0 ||
+       oufs_directory_remove(&dir_src, local_src) != 0) {
+      fprintf(stderr, "Cannot add %s to the destination parent.\n", local_dst);
+      return(-8);
+    }
+
+    if(inode_src.type == FILE_TYPE) {
+      inode_src.n_references++;
+      oufs_write_inode_by_reference(child_src, &inode_src);
+    }
+    if(oufs_directory_write(&dir_dst) != 0) {
+      // The old name is all there is
+      if(inode_src.type == FILE_TYPE) {
+	inode_src.n_references--;
+	oufs_write_inode_by_reference(child_src, &inode_src);
+      }
+      return(-9);
+    }
+    oufs_directory_write(&dir_src);
+    if(inode_src.type == FILE_TYPE) {
+      inode_src.n_references--;
+      oufs_write_inode_by_reference(child_src, &inode_src);
+    }else{
+      // A moved directory has a new ..
+      OUDIR dir;
+      int i;
+      if(oufs_directory_load(child_src, &inode_src, &dir) != 0 ||
+	 (i = oufs_directory_lookup(&dir, "..")) < 0) {
+	return(-10);
+      }
+      dir.block.content.directory.entry[i].inode_reference = parent_dst;
+      oufs_directory_write(&dir);
+    }
+  }
+
+  // A replaced file loses the name
+  if(child_dst != UNALLOCATED_INODE) {
+    drop_reference(child_dst, &inode_dst);
+  }
+
+  return(0);
+}
+
+
+/**
+ * State of a consistency check: what the directory tree says the master
+ *   block should contain
+ */
+typedef struct check_state_s
+{
+  BLOCK master;
+  int repair;
+  int n_problems;
+  int n_repaired;
+
+  // Inodes reached from the root, and the inode slots holding inline data
+  unsigned char reached[N_INODES];
+  unsigned char inline_slot[N_INODES];
+
+  // Number of directory entries that refer to each inode
+  int n_entries[N_INODES];
+
+  // Number of inodes using each block, and whether all of them are
+  //  chained files (the only kind of block that may be shared)
+  int n_users[N_BLOCKS];
+  unsigned char shareable[N_BLOCKS];
+} CHECK_STATE;
+
+/**
+ * Record a problem found by oufs_check() that is repaired in repair mode
+ */
+static void check_problem(CHECK_STATE *state, char *format, int a, int b)
+{
+  ++state->n_problems;
+  if(state->repair)
+    ++state->n_repaired;
+  printf(format, a, b);
+  printf("%s\n", state->repair ? " (repaired)" : "");
+}
+
+/**
+ * Record a problem found by oufs_check() that is only reported
+ */
+static void check_report(CHECK_STATE *state, char *format, int a, int b)
+{
+  ++state->n_problems;
+  printf(format, a, b);
+  printf("\n");
+}
+
+/**
+ * Record that an inode uses a block
+ *
+ * @return 0 if the reference is valid; -1 if not
+ */
+static int check_use_block(CHECK_STATE *state, INODE_REFERENCE owner, BLOCK_REFERENCE b,
+			   int shareable)
+{
+  if(b <= ROOT_DIRECTORY_BLOCK && !(owner == ROOT_DIRECTORY_INODE && b == ROOT_DIRECTORY_BLOCK)) {
+    check_report(state, "Inode %d: refers to reserved or invalid block %d", owner, b);
+    return(-1);
+  }
+  if(b >= N_BLOCKS) {
+    check_report(state, "Inode %d: refers to invalid block %d", owner, b);
+    return(-1);
+  }
+  state->shareable[b] = (state->n_users[b] == 0 ? shareable : state->shareable[b] && shareable);
+  ++state->n_users[b];
+  return(0);
+}
+
+/**
+ * Check the contents of a file inode: inline slots, index block or chain,
+ *   against its size
+ */
+static void check_file(CHECK_STATE *state, INODE_REFERENCE i, INODE *inode)
+{
+  int n_data_blocks = (inode->size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+  BLOCK block;
+
+  if(inode->size > MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE) {
+    check_problem(state, "Inode %d: size %d is larger than a file can be", i, inode->size);
+    inode->size = MAX_BLOCKS_IN_FILE * DATA_BLOCK_SIZE;
+    n_data_blocks = MAX_BLOCKS_IN_FILE;
+    if(state->repair)
+      oufs_write_inode_by_reference(i, inode);
+  }
+
+  if(inode->flags & INODE_INLINE_DATA) {
+    int n = (inode->size + sizeof(INODE) - 1) / sizeof(INODE);
+    if(inode->size > OUFS_INLINE_DATA_SIZE || inode->content + n > N_INODES) {
+      check_report(state, "Inode %d: bad inline data (slot %d)", i, inode->content);
+      return;
+    }
+    for(int j = inode->content; j < inode->content + n; ++j)
+      state->inline_slot[j] = 1;
+    return;
+  }
+
+  if(inode->content == UNALLOCATED_BLOCK) {
+    if(inode->size > 0 && !(inode->flags & INODE_INDEXED))
+      check_problem(state, "Inode %d: size %d but no data blocks", i, inode->size);
+    if(inode->size > 0 && state->repair) {
+      inode->size = 0;
+      oufs_write_inode_by_reference(i, inode);
+    }
+    return;
+  }
 
-  virtual_disk_read_block(inode_dst.content, &block);
-  for (int i = 0; i < N_DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-    if (block.content.directory.entry[i].inode_reference == UNALLOCATED_INODE) {
-      block.content.directory.entry[i].inode_reference = child_src;
-      strcpy(block.content.directory.entry[i].name, local_name);
+  if(inode->flags & INODE_INDEXED) {
+    // Index block: holes are allowed
+    if(check_use_block(state, i, inode->content, 0) != 0 ||
+       virtual_disk_read_block(inode->content, &block) != 0)
+      return;
+    for(int j = 0; j < n_data_blocks; ++j)
+      if(block.content.index.block[j] != UNALLOCATED_BLOCK)
+	check_use_block(state, i, block.content.index.block[j], 0);
+    return;
+  }
+
+  // Chain: exactly as many blocks as the size needs
+  BLOCK_REFERENCE b = inode->content;
+  BLOCK_REFERENCE last = UNALLOCATED_BLOCK;
+  int n = 0;
+  while(b != UNALLOCATED_BLOCK && n < n_data_blocks) {
+    if(check_use_block(state, i, b, 1) != 0 || virtual_disk_read_block(b, &block) != 0)
+      break;
+    ++n;
+    last = b;
+    b = block.next_block;
+  }
+  if(n < n_data_blocks) {
+    check_problem(state, "Inode %d: chain has %d blocks, but the size needs more", i, n);
+    if(state->repair) {
+      inode->size = n * DATA_BLOCK_SIZE;
+      oufs_write_inode_by_reference(i, inode);
+    }
+  }else if(b != UNALLOCATED_BLOCK) {
+    check_problem(state, "Inode %d: chain continues past block %d", i, last);
+    if(state->repair) {
+      virtual_disk_read_block(last, &block);
+      block.next_block = UNALLOCATED_BLOCK;
+      virtual_disk_write_block(last, &block);
+    }
+  }
+}
+
+/**
+ * Check a directory and everything below it
+ *
+ * @param state Check state
+ * @param d Inode reference of the directory (already marked as reached)
+ * @param parent Inode reference that its .. must refer to
+ */
+static void check_directory(CHECK_STATE *state, INODE_REFERENCE d, INODE_REFERENCE parent)
+{
+  OUDIR dir;
+  char name[OUFS_MAX_NAME_LENGTH + 1];
+  char names[N_DIRECTORY_ENTRIES_PER_BLOCK][OUFS_MAX_NAME_LENGTH + 1];
+  int unsorted = 0;
+  int unreadable = 0;
+  int dirty = 0;
+
+  if(oufs_directory_load(d, NULL, &dir) != 0 || dir.n_entries > N_DIRECTORY_ENTRIES_PER_BLOCK) {
+    check_report(state, "Inode %d: unreadable directory", d, 0);
+    return;
+  }
+  if(check_use_block(state, d, dir.inode.content, 0) != 0)
+    return;
+
+  // Name heap blocks
+  BLOCK block;
+  BLOCK_REFERENCE b = dir.block.next_block;
+  for(int j = 0; j < dir.n_heap_blocks; ++j) {
+    if(b == UNALLOCATED_BLOCK || check_use_block(state, d, b, 0) != 0 ||
+       virtual_disk_read_block(b, &block) != 0) {
+      check_report(state, "Inode %d: name heap is missing block %d", d, j);
       break;
     }
+    b = block.next_block;
+  }
+
+  for(int j = 0; j < dir.n_entries; ++j) {
+    DIRECTORY_ENTRY *entry = &dir.block.content.directory.entry[j];
+    INODE_REFERENCE child = entry->inode_reference;
+    INODE inode;
+
+    if(oufs_directory_get_name(&dir, j, name) != 0 || child >= N_INODES ||
+       oufs_read_inode_by_reference(child, &inode) != 0) {
+      check_report(state, "Inode %d: bad entry %d", d, j);
+      unreadable = 1;
+      continue;
+    }
+    if(j > 0 && !unreadable && strcmp(names[j - 1], name) >= 0)
+      unsorted = 1;
+    strcpy(names[j], name);
+
+    if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      if(child != (name[1] == 0 ? d : parent))
+	check_problem(state, "Inode %d: entry %d (. or ..) points to the wrong directory", d, j);
+      if(child != (name[1] == 0 ? d : parent) && state->repair) {
+	entry->inode_reference = (name[1] == 0 ? d : parent);
+	dirty = 1;
+      }
+      continue;
+    }
+
+    if(inode.type != entry->type) {
+      check_problem(state, "Inode %d: entry %d has the wrong type", d, j);
+      entry->type = inode.type;
+      dirty = 1;
+    }
+    ++state->n_entries[child];
+
+    if(inode.type == DIRECTORY_TYPE) {
+      if(state->reached[child]) {
+	check_report(state, "Inode %d: directory %d is entered more than once", d, child);
+      }else{
+	state->reached[child] = 1;
+	check_directory(state, child, d);
+      }
+    }else if(inode.type == FILE_TYPE) {
+      if(!state->reached[child]) {
+	state->reached[child] = 1;
+	check_file(state, child, &inode);
+      }
+    }else{
+      check_report(state, "Inode %d: entry %d refers to an unused inode", d, j);
+    }
+  }
+
+  // Entries out of order are sorted again (if all of the names could be read)
+  if(unsorted && unreadable) {
+    check_report(state, "Inode %d: entries are out of order", d, 0);
+  }else if(unsorted) {
+    check_problem(state, "Inode %d: entries are out of order", d, 0);
+    for(int j = 1; j < dir.n_entries; ++j) {
+      DIRECTORY_ENTRY entry = dir.block.content.directory.entry[j];
+      strcpy(name, names[j]);
+      int k = j;
+      for(; k > 0 && strcmp(names[k - 1], name) > 0; --k) {
+	dir.block.content.directory.entry[k] = dir.block.content.directory.entry[k - 1];
+	strcpy(names[k], names[k - 1]);
+      }
+      dir.block.content.directory.entry[k] = entry;
+      strcpy(names[k], name);
+    }
+    dirty = 1;
+  }
+
+  if(dirty && state->repair)
+    virtual_disk_write_block(dir.inode.content, &dir.block);
+}
+
+/**
+ * Check the consistency of the file system on the attached disk
+ *
+ * The directory tree is walked from the root, and the master block, the
+ *  inodes and the directories are checked against what it implies:
+ *  - the inode table bits against the reachable inodes and inline data slots
+ *  - the block table bits against the blocks in use (directories, name heaps,
+ *     chains, index blocks and their data blocks)
+ *  - block sharing counts against the number of files using each block
+ *  - the free block and free inode counts against the (repaired) tables
+ *  - n_references against the number of directory entries
+ *  - file sizes against the length of their chains
+ *  - directory sizes, sort order, entry types, . and ..
+ *
+ * Problems are printed as they are found.  With repair, the master block,
+ *  reference counts, entry types, sizes and the order of directory entries
+ *  are rewritten to match the tree; inodes that cannot be reached are
+ *  freed, and so are the blocks that no file uses.  Other problems (bad
+ *  references, blocks or directories used twice) are only reported.
+ *
+ * @param repair Nonzero to repair the problems
+ * @param n_repaired Set to the number of problems that were repaired
+ * @return The number of problems found
+ *         -x if error
+ */
+int oufs_check(int repair, int *n_repaired)
+{
+  OUFS_MEASURE(OUFS_OP_CHECK);
+  if(oufs_check_format() != 0) {
+    return(-3);
+  }
+  CHECK_STATE *state = (CHECK_STATE *) calloc(1, sizeof(CHECK_STATE));
+  if(state == NULL) {
+    return(-1);
+  }
+  state->repair = repair;
+  if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &state->master) != 0) {
+    free(state);
+    return(-2);
+  }
+  MASTER_BLOCK *master = &state->master.content.master;
+
+  // Walk the tree
+  state->reached[ROOT_DIRECTORY_INODE] = 1;
+  state->n_entries[ROOT_DIRECTORY_INODE] = 1;
+  check_directory(state, ROOT_DIRECTORY_INODE, ROOT_DIRECTORY_INODE);
+
+  // Inodes: table bits and reference counts
+  for(int i = 0; i < N_INODES; ++i) {
+    int used = state->reached[i] || state->inline_slot[i];
+    int marked = (master->inode_allocated_flag[i >> 3] >> (7 - (i & 7))) & 1;
+    INODE inode;
+
+    if(state->reached[i] && state->inline_slot[i]) {
+      check_report(state, "Inode %d: is also used for inline data", i, 0);
+    }
+    if(used != marked) {
+      check_problem(state, used ? "Inode %d: in use but marked free" :
+		    "Inode %d: marked in use but unreachable", i, 0);
+      master->inode_allocated_flag[i >> 3] ^= (1 << (7 - (i & 7)));
+      if(!used && repair) {
+	// Free the orphan; its blocks are freed below, as nothing uses them
+	memset(&inode, 0, sizeof(INODE));
+	inode.content = UNALLOCATED_INODE;
+	oufs_write_inode_by_reference(i, &inode);
+      }
+    }
+    if(!state->reached[i] || oufs_read_inode_by_reference(i, &inode) != 0)
+      continue;
+    int expected = (inode.type == DIRECTORY_TYPE) ? 1 : state->n_entries[i];
+    if(inode.n_references != expected) {
+      check_problem(state, "Inode %d: n_references should be %d", i, expected);
+      if(repair) {
+	inode.n_references = expected;
+	oufs_write_inode_by_reference(i, &inode);
+      }
+    }
+  }
+
+  // Blocks: table bits and sharing
+  for(int b = 0; b < N_BLOCKS; ++b) {
+    int used = (b <= ROOT_DIRECTORY_BLOCK) || state->n_users[b] > 0;
+    int marked = (master->block_allocated_flag[b >> 3] >> (7 - (b & 7))) & 1;
+    int shares = (state->n_users[b] > 1) ? state->n_users[b] - 1 : 0;
+
+    if(used != marked) {
+      check_problem(state, used ? "Block %d: in use but marked free" :
+		    "Block %d: marked in use but unused", b, 0);
+      master->block_allocated_flag[b >> 3] ^= (1 << (7 - (b & 7)));
+    }
+    if(state->n_users[b] > 1 && !state->shareable[b]) {
+      check_report(state, "Block %d: used by %d inodes", b, state->n_users[b]);
+    }
+    if(master->block_shares[b] != shares) {
+      check_problem(state, "Block %d: share count should be %d", b, shares);
+      master->block_shares[b] = shares;
+    }
+  }
+
+  // Free counts
+  BLOCK counted = state->master;
+  oufs_count_free(&counted);
+  if(master->n_free_blocks != counted.content.master.n_free_blocks) {
+    check_problem(state, "Master block: free block count should be %d",
+		  counted.content.master.n_free_blocks, 0);
+    master->n_free_blocks = counted.content.master.n_free_blocks;
+  }
+  if(master->n_free_inodes != counted.content.master.n_free_inodes) {
+    check_problem(state, "Master block: free inode count should be %d",
+		  counted.content.master.n_free_inodes, 0);
+    master->n_free_inodes = counted.content.master.n_free_inodes;
+  }
+
+  if(repair && virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &state->master) != 0) {
+    free(state);
+    return(-3);
+  }
+
+  int n_problems = state->n_problems;
+  *n_repaired = state->n_repaired;
+  free(state);
+  return(n_problems);
+}
+
+
+/**
+ * Call visit() once for every file in the directory tree below d
+ *
+ * @param d Inode reference of the directory
+ * @param visit Function to call with the inode reference and inode of each file
+ * @param arg Passed on to visit()
+ * @param seen One flag per inode, so that linked files are visited once
+ */
+static void walk_files(INODE_REFERENCE d, void (*visit)(INODE_REFERENCE, INODE *, void *),
+		       void *arg, unsigned char *seen)
+{
+  OUDIR *dir = (OUDIR *) malloc(sizeof(OUDIR));
+  if(dir == NULL || oufs_directory_load(d, NULL, dir) != 0) {
+    free(dir);
+    return;
   }
 
-  virtual_disk_write_block(inode_dst.content, &block);
-  inode_dst.size++;
-  oufs_write_inode_by_reference(parent_dst, &inode_dst);
+  for(int i = 0; i < dir->n_entries; ++i) {
+    DIRECTORY_ENTRY *entry = &dir->block.content.directory.entry[i];
+    INODE inode;
+    if(entry->inode_reference >= N_INODES || seen[entry->inode_reference] ||
+       oufs_read_inode_by_reference(entry->inode_reference, &inode) != 0)
+      continue;
+    seen[entry->inode_reference] = 1;
+    if(inode.type == DIRECTORY_TYPE)
+      walk_files(entry->inode_reference, visit, arg, seen);
+    else if(inode.type == FILE_TYPE)
+      visit(entry->inode_reference, &inode, arg);
+  }
+  free(dir);
+}
+
+/**
+ * Number of runs of consecutive blocks in a block map (holes are skipped)
+ */
+static int count_extents(BLOCK_REFERENCE *refs, int n_blocks)
+{
+  int n_extents = 0;
+  for(int i = 0; i < n_blocks; ++i)
+    if(refs[i] != UNALLOCATED_BLOCK && (i == 0 || refs[i] != refs[i - 1] + 1))
+      ++n_extents;
+  return(n_extents);
+}
+
+/**
+ * walk_files() visitor for oufs_fragmentation()
+ */
+static void measure_file(INODE_REFERENCE i, INODE *inode, void *arg)
+{
+  FRAGMENTATION *frag = (FRAGMENTATION *) arg;
+  BLOCK_REFERENCE refs[MAX_BLOCKS_IN_FILE];
+  int n = oufs_load_block_map(inode, refs);
+  int n_extents = (n > 0) ? count_extents(refs, n) : 0;
+
+  if(n_extents == 0)
+    return;
+  ++frag->n_files;
+  for(int j = 0; j < n; ++j)
+    if(refs[j] != UNALLOCATED_BLOCK)
+      ++frag->n_blocks;
+  frag->n_extents += n_extents;
+  if(n_extents > 1)
+    ++frag->n_fragmented;
+}
+
+/**
+ * Measure how fragmented the files on the attached disk are
+ *
+ * @param frag Filled in with the number of files, blocks and extents
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_fragmentation(FRAGMENTATION *frag)
+{
+  OUFS_MEASURE(OUFS_OP_FRAGMENTATION);
+  unsigned char seen[N_INODES] = {0};
+
+  memset(frag, 0, sizeof(FRAGMENTATION));
+  if(oufs_check_format() != 0) {
+    return(-1);
+  }
+  seen[ROOT_DIRECTORY_INODE] = 1;
+  walk_files(ROOT_DIRECTORY_INODE, measure_file, frag, seen);
   return(0);
 }
+
+/**
+ * walk_files() visitor for oufs_defrag(): move a fragmented file into
+ *   fewer runs of consecutive blocks (one, if there is a free run for it)
+ *
+ * The move is ordered so that an interruption never loses data:
+ *  1. the copies are written to free blocks
+ *  2. the master block is written with the copies allocated
+ *  3. the inode (chained files) or index block (indexed files) is switched
+ *     to the copies: this single write is the point at which the file moves
+ *  4. the master block is written with the old blocks freed
+ * An interruption between steps 2 and 4 only leaves allocated blocks that
+ *  no file uses, which oufs_fsck -r reclaims.
+ */
+static void defrag_file(INODE_REFERENCE i, INODE *inode, void *arg)
+{
+  int *n_moved = (int *) arg;
+  BLOCK_REFERENCE refs[MAX_BLOCKS_IN_FILE];
+  BLOCK_REFERENCE new_refs[MAX_BLOCKS_IN_FILE];
+  BLOCK master;
+  BLOCK trial;
+  BLOCK index;
+
+  int n = oufs_load_block_map(inode, refs);
+  int n_extents = (n > 0) ? count_extents(refs, n) : 0;
+  if(n_extents <= 1 || virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return;
+
+  // Shared chains belong to several files: leave them where they are
+  if(!(inode->flags & INODE_INDEXED) && master.content.master.block_shares[inode->content] > 0)
+    return;
+
+  // Only move the file if the free blocks that it would get are in fewer
+  //  runs.  The allocator is deterministic, so oufs_copy_blocks() picks the
+  //  same blocks
+  int n_used = 0;
+  for(int j = 0; j < n; ++j)
+    if(refs[j] != UNALLOCATED_BLOCK)
+      ++n_used;
+  trial = master;
+  if(oufs_allocate_blocks(&trial, UNALLOCATED_BLOCK, n_used, new_refs) != 0 ||
+     count_extents(new_refs, n_used) >= n_extents)
+    return;
+
+  if(oufs_copy_blocks(&master, refs, n, new_refs) != 0 ||
+     virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return;
+
+  if(inode->flags & INODE_INDEXED) {
+    if(virtual_disk_read_block(inode->content, &index) != 0)
+      return;
+    memcpy(index.content.index.block, new_refs, n * sizeof(BLOCK_REFERENCE));
+    if(virtual_disk_write_block(inode->content, &index) != 0)
+      return;
+  }else{
+    inode->content = new_refs[0];
+    if(oufs_write_inode_by_reference(i, inode) != 0)
+      return;
+  }
+
+  int n_freed = 0;
+  for(int j = 0; j < n; ++j) {
+    if(refs[j] != UNALLOCATED_BLOCK) {
+      oufs_deallocate_block(&master, refs[j]);
+      refs[n_freed++] = refs[j];
+    }
+  }
+  virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+  oufs_discard_blocks(refs, n_freed);
+
+  ++*n_moved;
+}
+
+/**
+ * Defragment the attached disk: every file whose data blocks are in more
+ *   than one run is moved into a single free run if there is one, or else
+ *   into free blocks that form fewer runs
+ *
+ * - Each file moves in one step (see defrag_file()), so the defragmenter
+ *    can be interrupted at any time
+ * - Files that share their blocks with clones are not moved
+ * - Directories need no compaction: their entries are always packed
+ *
+ * @return The number of files moved
+ *         -x if error
+ */
+int oufs_defrag()
+{
+  OUFS_MEASURE(OUFS_OP_DEFRAG);
+  unsigned char seen[N_INODES] = {0};
+  int n_moved = 0;
+
+  if(oufs_check_format() != 0) {
+    return(-1);
+  }
+  seen[ROOT_DIRECTORY_INODE] = 1;
+  walk_files(ROOT_DIRECTORY_INODE, defrag_file, &n_moved, seen);
+  return(n_moved);
+}
@@ -1,5 +1,6 @@
 #ifndef OUFS_LIB_H
 #define OUFS_LIB_H
+#include <sys/uio.h>
 #include "oufs.h"
 
 #define MAX_PATH_LENGTH 200
@@ -8,18 +9,47 @@
 void oufs_get_environment(char *cwd, char *disk_name, char *pipe_name_base);
 
 // PROJECT 3: to implement
-int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base);
+int oufs_format_disk(char  *virtual_disk_name, char *pipe_name_base, int fast);
 int oufs_mkdir(char *cwd, char *path);
 int oufs_list(char *cwd, char *path);
+int oufs_list_prefix(char *cwd, char *path, char *prefix);
+OUDIR *oufs_opendir(char *cwd, char *path);
+OUDIRENT *oufs_readdir(OUDIR *dp);
+void oufs_seekdir(OUDIR *dp, char *name);
+void oufs_closedir(OUDIR *dp);
 int oufs_rmdir(char *cwd, char *path);
+int oufs_trim();
+int oufs_statfs(OUFS_STATFS *st);
+int oufs_check(int repair, int *n_repaired);
+int oufs_fragmentation(FRAGMENTATION *frag);
+int oufs_defrag();
 
 // PROJECT 4: to implement
 OUFILE* oufs_fopen(char *cwd, char *path, char *mode);
+OUFILE* oufs_fopen_hint(char *cwd, char *path, char *mode, int size_hint);
 void oufs_fclose(OUFILE *fp);
 int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len);
 int oufs_fread(OUFILE *fp, unsigned char * buf, int len);
 int oufs_remove(char *cwd, char *path);
 int oufs_link(char *cwd, char *path_src, char *path_dst);
+int oufs_rename(char *cwd, char *path_src, char *path_dst);
+int oufs_copy_file(char *cwd, char *path_src, char *path_dst, int clone);
+
+// Vectored and zero-copy file I/O
+int oufs_fwritev(OUFILE *fp, const struct iovec *iov, int iovcnt);
+int oufs_freadv(OUFILE *fp, const struct iovec *iov, int iovcnt);
+int oufs_fread_views(OUFILE *fp, struct iovec *iov, int iovcnt, int len);
+void oufs_release_views(struct iovec *iov, int iovcnt);
+
+// Random access and sparse files
+int oufs_fseek(OUFILE *fp, int offset);
+int oufs_fpunch(OUFILE *fp, int offset, int len);
+
+// Preallocation
+int oufs_fallocate(OUFILE *fp, int len);
+
+// Delayed allocation: buffered writes
+int oufs_fflush(OUFILE *fp);
 
 #endif
 
@@ -10,15 +10,127 @@
 #include <stdlib.h>
 #include "virtual_disk.h"
 #include "oufs_lib_support.h"
+#include "oufs_metrics.h"
+#include "oufs_trace.h"
 
-extern int debug;
+
+/**
+ * Is a block marked as allocated in the master block?
+ */
+static int block_is_allocated(BLOCK *master_block, int i)
+{
+  return((master_block->content.master.block_allocated_flag[i >> 3] & (1 << (7 - (i & 7)))) != 0);
+}
+
+/**
+ * Mark a run of blocks as allocated or free in the master block, keeping
+ *   the free block count up to date
+ */
+static void set_block_bits(BLOCK *master_block, BLOCK_REFERENCE first, int n, int allocated)
+{
+  for(int i = first; i < first + n; ++i) {
+    if(block_is_allocated(master_block, i) == allocated)
+      continue;
+    if(allocated) {
+      master_block->content.master.block_allocated_flag[i >> 3] |= (1 << (7 - (i & 7)));
+      master_block->content.master.n_free_blocks--;
+    }else{
+      master_block->content.master.block_allocated_flag[i >> 3] &= ~(1 << (7 - (i & 7)));
+      master_block->content.master.n_free_blocks++;
+    }
+  }
+}
+
+/**
+ * Is an inode (or inline data slot) marked as allocated in the master block?
+ */
+static int inode_is_allocated(BLOCK *master_block, int i)
+{
+  return((master_block->content.master.inode_allocated_flag[i >> 3] & (1 << (7 - (i & 7)))) != 0);
+}
+
+/**
+ * Mark a run of inode slots as allocated or free in the master block,
+ *   keeping the free inode count up to date
+ */
+static void set_inode_bits(BLOCK *master_block, INODE_REFERENCE first, int n, int allocated)
+{
+  for(int i = first; i < first + n; ++i) {
+    if(inode_is_allocated(master_block, i) == allocated)
+      continue;
+    if(allocated) {
+      master_block->content.master.inode_allocated_flag[i >> 3] |= (1 << (7 - (i & 7)));
+      master_block->content.master.n_free_inodes--;
+    }else{
+      master_block->content.master.inode_allocated_flag[i >> 3] &= ~(1 << (7 - (i & 7)));
+      master_block->content.master.n_free_inodes++;
+    }
+  }
+}
+
+/**
+ * Mark a single inode as allocated or free in the master block
+ *
+ * @param master_block A link to a buffer ALREADY containing the master block.
+ *    This buffer is modified, but not written to the disk.
+ * @param i Reference of the inode
+ * @param allocated Nonzero to mark the inode as allocated
+ */
+void oufs_mark_inode(BLOCK *master_block, INODE_REFERENCE i, int allocated)
+{
+  set_inode_bits(master_block, i, 1, allocated != 0);
+}
+
+/**
+ * Check that the attached disk has the layout that this library reads.
+ *   Disks formatted with another OUFS_FORMAT_VERSION would be misread, so
+ *   the library refuses to work on them (the message is printed once)
+ *
+ * @return 0 if the disk can be used
+ *         -x if the master block cannot be read or the format version differs
+ */
+int oufs_check_format()
+{
+  static int reported = 0;
+  BLOCK master;
+
+  if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0)
+    return(-1);
+  if(master.content.master.format_version != OUFS_FORMAT_VERSION) {
+    if(!reported)
+      fprintf(stderr, "Disk has format version %d, expected %d: reformat it\n",
+	      master.content.master.format_version, OUFS_FORMAT_VERSION);
+    reported = 1;
+    return(-2);
+  }
+  return(0);
+}
+
+/**
+ * Set the free block and free inode counts of the master block from its
+ *   allocation tables (after the tables were changed directly)
+ *
+ * @param master_block A link to a buffer ALREADY containing the master block.
+ *    This buffer is modified, but not written to the disk.
+ */
+void oufs_count_free(BLOCK *master_block)
+{
+  master_block->content.master.n_free_blocks = 0;
+  for(int i = 0; i < N_BLOCKS; ++i)
+    if(!block_is_allocated(master_block, i))
+      master_block->content.master.n_free_blocks++;
+
+  master_block->content.master.n_free_inodes = 0;
+  for(int i = 0; i < N_INODES; ++i)
+    if(!inode_is_allocated(master_block, i))
+      master_block->content.master.n_free_inodes++;
+}
 
 /**
  * Deallocate a single block.
- * - Modify the in-memory copy of the master block
- * - Add the specified block to THE END of the free block linked list
- * - Modify the disk copy of the deallocated block: next_block points to
- *     UNALLOCATED_BLOCK
+ * - Modify the in-memory copy of the master block: the block is marked
+ *     as free
+ * - The block itself is not touched
  *
  * @param master_block Pointer to a loaded master block.  Changes to the MB will
  *           be made here, but not written to disk
@@ -28,40 +140,58 @@ extern int debug;
  */
 int oufs_deallocate_block(BLOCK *master_block, BLOCK_REFERENCE block_reference)
 {
-  BLOCK b;
-
-  if(master_block->content.master.unallocated_front == UNALLOCATED_BLOCK) {
-    // No blocks on the free list.  Both pointers point to this block now
-    master_block->content.master.unallocated_front = master_block->content.master.unallocated_end =
-      block_reference;
-
-  } else {
-    BLOCK c;
-    BLOCK_REFERENCE br = master_block->content.master.unallocated_end;
-    if (virtual_disk_read_block(br, &c) != 0)
-      return (-1);
-    c.next_block = block_reference;
-    master_block->content.master.unallocated_end = block_reference;
-    virtual_disk_write_block(br, &c);
-  }
-
-  // Update the new end block
-  if(virtual_disk_read_block(block_reference, &b) != 0) {
-    fprintf(stderr, "deallocate_block: error reading new end block %d\n", block_reference);
+  if(block_reference >= N_BLOCKS || !block_is_allocated(master_block, block_reference)) {
+    fprintf(stderr, "deallocate_block: block %d is not allocated\n", block_reference);
     return(-1);
   }
 
-  // Change the new end block to point to nowhere
-  b.next_block = UNALLOCATED_BLOCK;
+  set_block_bits(master_block, block_reference, 1, 0);
+  OUFS_TRACE_EVENT(TRACE_BLOCK_FREE, block_reference, 0);
+  return(0);
+};
 
-  // Write the block back
-  if(virtual_disk_write_block(block_reference, &b) != 0) {
-    fprintf(stderr, "deallocate_block: error writing new end block\n");
-    return(-1);
+
+/**
+ * Discard freed blocks on the host: one request per run of consecutive
+ * blocks in the list
+ * - Call this only once the master block that frees them has been written
+ *
+ * @param refs Block references (UNALLOCATED_BLOCK entries are skipped)
+ * @param n_blocks Number of entries in refs
+ */
+void oufs_discard_blocks(BLOCK_REFERENCE *refs, int n_blocks)
+{
+  for(int i = 0, j; i < n_blocks; i = j) {
+    for(j = i + 1; j < n_blocks && refs[i] != UNALLOCATED_BLOCK &&
+	  refs[j] == refs[j - 1] + 1; ++j)
+      ;
+    if(refs[i] != UNALLOCATED_BLOCK)
+      virtual_disk_discard_blocks(refs[i], j - i);
   }
+}
 
-  return(0);
-};
+/**
+ * Discard every free block of the disk on the host, one request per run
+ * of free blocks
+ *
+ * @param master_block A link to a buffer ALREADY containing the master block
+ * @return The number of blocks discarded
+ */
+int oufs_discard_free_blocks(BLOCK *master_block)
+{
+  int n = 0;
+
+  for(int i = 0, run = 0; i <= N_BLOCKS; ++i) {
+    if(i < N_BLOCKS && !block_is_allocated(master_block, i)) {
+      ++run;
+    }else if(run > 0) {
+      if(virtual_disk_discard_blocks(i - run, run) == 0)
+	n += run;
+      run = 0;
+    }
+  }
+  return(n);
+}
 
 
 /**
@@ -87,12 +217,15 @@ void oufs_init_directory_structures(INODE *inode, BLOCK *block,
   inode->type = DIRECTORY_TYPE;
   inode->size = 2;
   inode->n_references = 1;
+  inode->flags = 0;
   inode->content = self_block_reference;
 
   block->content.directory.entry[0].inode_reference = self_inode_reference;
+  block->content.directory.entry[0].type = DIRECTORY_TYPE;
   strcpy(block->content.directory.entry[0].name, ".");
 
   strcpy(block->content.directory.entry[1].name, "..");
+  block->content.directory.entry[1].type = DIRECTORY_TYPE;
   block->content.directory.entry[1].inode_reference = parent_inode_reference;
   
   for (int i = 2; i < N_DIRECTORY_ENTRIES_PER_BLOCK; i++) {
@@ -114,8 +247,7 @@ void oufs_init_directory_structures(INODE *inode, BLOCK *block,
  */
 int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
 {
-  if(debug)
-    fprintf(stderr, "\tDEBUG: Fetching inode %d\n", i);
+  OUFS_TRACE_EVENT(TRACE_INODE_READ, i, 0);
 
   // Find the address of the inode block and the inode within the block
   BLOCK_REFERENCE block = i / N_INODES_PER_BLOCK + 1;
@@ -144,8 +276,7 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
  */
 int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
 {
-  if(debug)
-    fprintf(stderr, "\tDEBUG: Writing inode %d\n", i);
+  OUFS_TRACE_EVENT(TRACE_INODE_WRITE, i, 0);
 
   // Find the address of the inode block and the inode within the block
   BLOCK_REFERENCE block = i / N_INODES_PER_BLOCK + 1;
@@ -182,11 +313,461 @@ void oufs_set_inode(INODE *inode, INODE_TYPE type, int n_references,
 {
   inode->type = type;
   inode->n_references = n_references;
+  inode->flags = 0;
   inode->content = content;
   inode->size = size;
 }
 
 
+/**
+ * Hash of a name, stored with long names so that a lookup only reads the
+ *   name heap for entries that are likely to match (FNV-1a, folded to 16 bits)
+ *
+ * @param name Name to hash
+ * @return The hash
+ */
+static unsigned short name_hash(char *name)
+{
+  unsigned int h = 2166136261u;
+  for(unsigned char *c = (unsigned char *) name; *c != 0; ++c) {
+    h ^= *c;
+    h *= 16777619u;
+  }
+  return((unsigned short) ((h >> 16) ^ h));
+}
+
+
+/**
+ * Offset just past the last tail of a long name in the name heap of a
+ *   loaded directory (0 if there are no long names)
+ */
+static int directory_heap_end(OUDIR *dp)
+{
+  int end = 0;
+  for(int i = 0; i < dp->n_entries; ++i) {
+    DIRECTORY_ENTRY *entry = &dp->block.content.directory.entry[i];
+    if(entry->name_length != 0)
+      end = MAX(end, entry->long_name.offset + entry->name_length - LONG_NAME_PREFIX_SIZE);
+  }
+  return(end);
+}
+
+/**
+ * Pack the tails of the long names of a loaded directory (whose heap has
+ *   been read) at the front of its name heap, dropping the tails of removed
+ *   names.  The packed heap must go to new blocks: see oufs_directory_write()
+ */
+static void directory_compact_heap(OUDIR *dp)
+{
+  char packed[OUFS_MAX_NAME_HEAP_BLOCKS * DATA_BLOCK_SIZE];
+  DIRECTORY_ENTRY *entry = dp->block.content.directory.entry;
+  int size = 0;
+
+  // Nothing to drop if the tails in use already fill the heap
+  for(int i = 0; i < dp->n_entries; ++i) {
+    if(entry[i].name_length != 0)
+      size += entry[i].name_length - LONG_NAME_PREFIX_SIZE;
+  }
+  if(size == dp->heap_size)
+    return;
+
+  size = 0;
+  for(int i = 0; i < dp->n_entries; ++i) {
+    if(entry[i].name_length != 0) {
+      int len = entry[i].name_length - LONG_NAME_PREFIX_SIZE;
+      memcpy(&packed[size], &dp->heap[entry[i].long_name.offset], len);
+      entry[i].long_name.offset = size;
+      size += len;
+    }
+  }
+  memcpy(dp->heap, packed, size);
+  dp->heap_size = size;
+  dp->heap_dirty = dp->heap_moved = 1;
+}
+
+
+/**
+ * Load a directory into memory
+ *
+ * - Only the directory block is read: the name heap is read by
+ *    directory_load_heap() the first time that a long name is needed
+ *
+ * @param inode_reference Reference to the directory inode
+ * @param inode The directory inode, if it has already been read (else NULL)
+ * @param dp Directory structure to fill in
+ * @return 0 if success
+ *         -1 if not a directory
+ *         -x if a read error
+ */
+int oufs_directory_load(INODE_REFERENCE inode_reference, INODE *inode, OUDIR *dp)
+{
+  dp->inode_reference = inode_reference;
+  if(inode != NULL) {
+    dp->inode = *inode;
+  }else if(oufs_read_inode_by_reference(inode_reference, &dp->inode) != 0) {
+    return(-2);
+  }
+  if(dp->inode.type != DIRECTORY_TYPE) {
+    return(-1);
+  }
+  if(virtual_disk_read_block(dp->inode.content, &dp->block) != 0) {
+    return(-3);
+  }
+
+  dp->n_entries = dp->inode.size;
+  dp->next_entry = 0;
+
+  // The heap ends with the last tail of a long name (it may also hold the
+  //  tails of removed names)
+  dp->heap_loaded = dp->heap_dirty = dp->heap_moved = 0;
+  dp->heap_size = directory_heap_end(dp);
+  dp->n_heap_blocks = (dp->heap_size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+
+  return(0);
+}
+
+
+/**
+ * Read the name heap of a loaded directory, if it has not been read yet
+ *
+ * @param dp Loaded directory
+ * @return 0 if success
+ *         -x if a read error
+ */
+static int directory_load_heap(OUDIR *dp)
+{
+  if(dp->heap_loaded)
+    return(0);
+
+  BLOCK block;
+  BLOCK_REFERENCE ref = dp->block.next_block;
+  for(int i = 0; i < dp->n_heap_blocks; ++i) {
+    if(ref == UNALLOCATED_BLOCK || virtual_disk_read_block(ref, &block) != 0) {
+      return(-1);
+    }
+    dp->heap_blocks[i] = ref;
+    memcpy(&dp->heap[i * DATA_BLOCK_SIZE], block.content.data.data, DATA_BLOCK_SIZE);
+    ref = block.next_block;
+  }
+  dp->heap_loaded = 1;
+  return(0);
+}
+
+
+/**
+ * Copy the full name of a directory entry
+ *
+ * @param dp Loaded directory
+ * @param i Index of the entry
+ * @param name Buffer of at least OUFS_MAX_NAME_LENGTH+1 characters
+ * @return 0 if success
+ *         -x if the name heap could not be read
+ */
+int oufs_directory_get_name(OUDIR *dp, int i, char *name)
+{
+  DIRECTORY_ENTRY *entry = &dp->block.content.directory.entry[i];
+
+  if(entry->name_length == 0) {
+    strncpy(name, entry->name, FILE_NAME_SIZE);
+    name[FILE_NAME_SIZE - 1] = 0;
+    return(0);
+  }
+
+  if(directory_load_heap(dp) != 0) {
+    return(-1);
+  }
+  memcpy(name, entry->long_name.prefix, LONG_NAME_PREFIX_SIZE);
+  memcpy(&name[LONG_NAME_PREFIX_SIZE], &dp->heap[entry->long_name.offset],
+	 entry->name_length - LONG_NAME_PREFIX_SIZE);
+  name[entry->name_length] = 0;
+  return(0);
+}
+
+
+/**
+ * Compare the first LONG_NAME_PREFIX_SIZE characters of an entry's name
+ *   with a name (the part of every name that is in the directory block)
+ */
+static int compare_prefix(DIRECTORY_ENTRY *entry, char *name)
+{
+  if(entry->name_length == 0)
+    return(strncmp(entry->name, name, LONG_NAME_PREFIX_SIZE));
+  return(strncmp(entry->long_name.prefix, name, LONG_NAME_PREFIX_SIZE));
+}
+
+
+/**
+ * Binary search for the first entry whose name does not come before
+ *   name in its first LONG_NAME_PREFIX_SIZE characters
+ */
+static int lower_bound_prefix(OUDIR *dp, char *name)
+{
+  int low = 0;
+  int high = dp->n_entries;
+
+  // Invariant: entries before low are < name, entries from high on are >= name
+  while(low < high) {
+    int mid = (low + high) / 2;
+    if(compare_prefix(&dp->block.content.directory.entry[mid], name) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return(low);
+}
+
+
+/**
+ * Find a name in a loaded directory
+ *
+ * - The valid entries of a directory are kept packed at the front of its
+ *    block (entries 0 ... size-1), sorted by name as defined by strcmp()
+ * - A binary search over the part of the names that is in the block finds
+ *    the candidates; for long names, the length and hash are compared before
+ *    the name heap is read
+ *
+ * @param dp Loaded directory
+ * @param name Name to look for
+ * @return Index of the entry holding name
+ *         -1 if it is not present
+ */
+int oufs_directory_lookup(OUDIR *dp, char *name)
+{
+  int len = strlen(name);
+  unsigned short hash = 0;
+  if(len >= FILE_NAME_SIZE)
+    hash = name_hash(name);
+
+  char entry_name[OUFS_MAX_NAME_LENGTH + 1];
+  for(int i = lower_bound_prefix(dp, name); i < dp->n_entries; ++i) {
+    DIRECTORY_ENTRY *entry = &dp->block.content.directory.entry[i];
+    if(compare_prefix(entry, name) != 0)
+      break;
+
+    if(len < FILE_NAME_SIZE) {
+      if(entry->name_length == 0 && strcmp(entry->name, name) == 0)
+	return(i);
+    }else if(entry->name_length == len && entry->long_name.hash == hash) {
+      if(oufs_directory_get_name(dp, i, entry_name) == 0 && strcmp(entry_name, name) == 0)
+	return(i);
+    }
+  }
+  return(-1);
+}
+
+
+/**
+ * Find the place of a name in a loaded directory
+ *
+ * @param dp Loaded directory
+ * @param name Name to look for
+ * @return Index of the entry holding name if it is present
+ *         -(i+1) if it is not, where i is the index at which it would be inserted
+ */
+int oufs_directory_search(OUDIR *dp, char *name)
+{
+  int i = oufs_directory_lookup(dp, name);
+  if(i >= 0)
+    return(i);
+
+  // Only names that share the prefix need to be compared in full
+  char entry_name[OUFS_MAX_NAME_LENGTH + 1];
+  for(i = lower_bound_prefix(dp, name); i < dp->n_entries; ++i) {
+    if(compare_prefix(&dp->block.content.directory.entry[i], name) != 0)
+      break;
+    if(oufs_directory_get_name(dp, i, entry_name) != 0 || strcmp(entry_name, name) > 0)
+      break;
+  }
+  return(-(i + 1));
+}
+
+
+/**
+ * Insert a new entry into a loaded directory, keeping the entries sorted
+ *
+ * - Only the directory in memory is changed: see oufs_directory_write()
+ *
+ * @param dp Loaded directory
+ * @param name Name of the new entry
+ * @param inode_reference Inode that the entry refers to
+ * @param type Type of that inode
+ * @return Index of the new entry if success
+ *         -1 if the name already exists
+ *         -2 if the directory is full
+ *         -3 if the name is too long
+ *         -4 if the name heap could not be read
+ */
+int oufs_directory_insert(OUDIR *dp, char *name, INODE_REFERENCE inode_reference,
+			  INODE_TYPE type)
+{
+  int len = strlen(name);
+  if(len > OUFS_MAX_NAME_LENGTH) {
+    return(-3);
+  }
+  if(dp->n_entries >= N_DIRECTORY_ENTRIES_PER_BLOCK) {
+    return(-2);
+  }
+  if(len >= FILE_NAME_SIZE && directory_load_heap(dp) != 0) {
+    return(-4);
+  }
+
+  int i = oufs_directory_search(dp, name);
+  if(i >= 0) {
+    return(-1);
+  }
+  i = -(i + 1);
+
+  // The tails of removed names are only dropped when the heap would
+  //  otherwise need another block
+  if(len >= FILE_NAME_SIZE &&
+     dp->heap_size + len - LONG_NAME_PREFIX_SIZE > dp->n_heap_blocks * DATA_BLOCK_SIZE) {
+    directory_compact_heap(dp);
+  }
+
+  // Open a slot by shifting the entries that come after the name
+  DIRECTORY_ENTRY *entry = dp->block.content.directory.entry;
+  memmove(&entry[i + 1], &entry[i], (dp->n_entries - i) * sizeof(DIRECTORY_ENTRY));
+  ++dp->n_entries;
+
+  memset(&entry[i], 0, sizeof(DIRECTORY_ENTRY));
+  entry[i].type = type;
+  entry[i].inode_reference = inode_reference;
+  if(len < FILE_NAME_SIZE) {
+    strcpy(entry[i].name, name);
+  }else{
+    // Long name: the tail goes at the end of the heap
+    memcpy(entry[i].long_name.prefix, name, LONG_NAME_PREFIX_SIZE);
+    entry[i].long_name.hash = name_hash(name);
+    entry[i].long_name.offset = dp->heap_size;
+    entry[i].name_length = len;
+    memcpy(&dp->heap[dp->heap_size], &name[LONG_NAME_PREFIX_SIZE], len - LONG_NAME_PREFIX_SIZE);
+    dp->heap_size += len - LONG_NAME_PREFIX_SIZE;
+    dp->heap_dirty = 1;
+  }
+
+  return(i);
+}
+
+
+/**
+ * Remove an entry from a loaded directory, keeping the entries packed
+ *
+ * - Only the directory in memory is changed: see oufs_directory_write()
+ *
+ * @param dp Loaded directory
+ * @param name Name of the entry to remove
+ * @return 0 if success
+ *         -1 if there is no such entry
+ *         -2 if the name heap could not be read
+ */
+int oufs_directory_remove(OUDIR *dp, char *name)
+{
+  int i = oufs_directory_lookup(dp, name);
+  if(i < 0) {
+    return(-1);
+  }
+
+  DIRECTORY_ENTRY *entry = dp->block.content.directory.entry;
+  int long_name = (entry[i].name_length != 0);
+  if(long_name && directory_load_heap(dp) != 0) {
+    return(-2);
+  }
+
+  memmove(&entry[i], &entry[i + 1], (dp->n_entries - i - 1) * sizeof(DIRECTORY_ENTRY));
+  --dp->n_entries;
+
+  memset(&entry[dp->n_entries], 0, sizeof(DIRECTORY_ENTRY));
+  entry[dp->n_entries].inode_reference = UNALLOCATED_INODE;
+
+  // The tail stays in the heap until the directory is written, so that no
+  //  tail that is still on disk is overwritten
+  if(long_name) {
+    dp->heap_dirty = 1;
+  }
+
+  return(0);
+}
+
+
+/**
+ * Write a loaded directory back: its name heap (if changed), its block
+ *   and its inode (whose size is the number of entries)
+ *
+ * - The heap gains or loses blocks as it grows or shrinks; a directory
+ *    whose names are all short has no heap blocks
+ * - The directory block write is what makes a change visible.  Heap
+ *    blocks that are rewritten in place only gain bytes past the names in
+ *    use; a compacted heap goes to new blocks.  Blocks that the heap no
+ *    longer uses are only freed once the directory block is written
+ *
+ * @param dp Loaded directory
+ * @return 0 if success
+ *         -1 if there are no free blocks for the heap
+ */
+int oufs_directory_write(OUDIR *dp)
+{
+  BLOCK master;
+  BLOCK block;
+  int n_freed = 0;
+  BLOCK_REFERENCE freed[OUFS_MAX_NAME_HEAP_BLOCKS];
+
+  if(dp->heap_dirty) {
+    // Space past the last tail in use is given back
+    int size = directory_heap_end(dp);
+    int n_blocks = (size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+    int n_kept = dp->heap_moved ? 0 : MIN(n_blocks, dp->n_heap_blocks);
+
+    if(n_blocks > n_kept) {
+      if(virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) != 0) {
+	return(-2);
+      }
+      // New blocks only become part of the heap once all of them are
+      //  allocated (the master block is not written on failure)
+      BLOCK_REFERENCE added[OUFS_MAX_NAME_HEAP_BLOCKS];
+      int n_added = 0;
+      for(; n_kept + n_added < n_blocks; ++n_added) {
+	added[n_added] = oufs_allocate_new_block(&master, &block);
+	if(added[n_added] == UNALLOCATED_BLOCK) {
+	  return(-1);
+	}
+      }
+      virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+      for(int i = n_kept; i < dp->n_heap_blocks; ++i)
+	freed[n_freed++] = dp->heap_blocks[i];
+      memcpy(&dp->heap_blocks[n_kept], added, n_added * sizeof(BLOCK_REFERENCE));
+    }else{
+      for(int i = n_blocks; i < dp->n_heap_blocks; ++i)
+	freed[n_freed++] = dp->heap_blocks[i];
+    }
+    dp->heap_size = size;
+    dp->n_heap_blocks = n_blocks;
+
+    // The heap blocks form a chain behind the directory block
+    for(int i = 0; i < dp->n_heap_blocks; ++i) {
+      memcpy(block.content.data.data, &dp->heap[i * DATA_BLOCK_SIZE], DATA_BLOCK_SIZE);
+      block.next_block = (i + 1 < dp->n_heap_blocks) ? dp->heap_blocks[i + 1] : UNALLOCATED_BLOCK;
+      virtual_disk_write_block(dp->heap_blocks[i], &block);
+    }
+    dp->block.next_block = (dp->n_heap_blocks > 0) ? dp->heap_blocks[0] : UNALLOCATED_BLOCK;
+    dp->heap_dirty = dp->heap_moved = 0;
+  }
+
+  if(virtual_disk_write_block(dp->inode.content, &dp->block) != 0) {
+    return(-3);
+  }
+
+  if(n_freed > 0 && virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master) == 0) {
+    for(int i = 0; i < n_freed; ++i)
+      oufs_deallocate_block(&master, freed[i]);
+    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master);
+    oufs_discard_blocks(freed, n_freed);
+  }
+
+  dp->inode.size = dp->n_entries;
+  return(oufs_write_inode_by_reference(dp->inode_reference, &dp->inode));
+}
+
+
 /*
  * Given a valid directory inode, return the inode reference for the sub-item
  * that matches <element_name>
@@ -199,18 +780,16 @@ void oufs_set_inode(INODE *inode, INODE_TYPE type, int n_references,
 
 int oufs_find_directory_element(INODE *inode, char *element_name)
 {
-  if(debug)
-    fprintf(stderr,"\tDEBUG: oufs_find_directory_element: %s\n", element_name);
-
-  BLOCK b;
-  virtual_disk_read_block(inode->content, &b);
-  for (int i = 0; i < N_DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-    if (b.content.directory.entry[i].inode_reference != UNALLOCATED_INODE) { 
-      if (strcmp(b.content.directory.entry[i].name, element_name) == 0)
-        return b.content.directory.entry[i].inode_reference;
-    }
+  OUDIR dir;
+  if(oufs_directory_load(UNALLOCATED_INODE, inode, &dir) != 0) {
+    return UNALLOCATED_INODE;
+  }
+  int i = oufs_directory_lookup(&dir, element_name);
+  OUFS_TRACE_EVENT(TRACE_DIRECTORY_LOOKUP, inode->content, i);
+  if(i < 0) {
+    return UNALLOCATED_INODE;
   }
-  return UNALLOCATED_INODE;
+  return dir.block.content.directory.entry[i].inode_reference;
 }
 
 /**
@@ -229,15 +808,19 @@ int oufs_find_directory_element(INODE *inode, char *element_name)
  *             (i.e., name relative to the parent)
  * @return 0 if no errors
  *         -1 if child not found
- *         -x if an error
+ *         -x if an error (or if the disk has another format version)
  *
  */
 int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child,
 		   char *local_name)
 {
+  OUFS_MEASURE(OUFS_OP_FIND_FILE);
   INODE_REFERENCE grandparent;
   char full_path[MAX_PATH_LENGTH];
 
+  if(oufs_check_format() != 0)
+    return(-3);
+
   // Construct an absolute path the file/directory in question
   if(path[0] == '/') {
     strncpy(full_path, path, MAX_PATH_LENGTH-1);
@@ -252,25 +835,17 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
     }
   }
 
-  if(debug) {
-    fprintf(stderr, "\tDEBUG: Full path: %s\n", full_path);
-  }
-
   // Start scanning from the root directory
   // Root directory inode
   grandparent = *parent = *child = 0;
-  if(debug)
-    fprintf(stderr, "\tDEBUG: Start search: %d\n", *parent);
 
   // Parse the full path
   char *directory_name;
   directory_name = strtok(full_path, "/");
   while(directory_name != NULL) {
-    if(strlen(directory_name) >= FILE_NAME_SIZE-1) 
-      // Truncate the name
-      directory_name[FILE_NAME_SIZE - 1] = 0;
-    if(debug){
-      fprintf(stderr, "\tDEBUG: Directory: %s\n", directory_name);
+    if(strlen(directory_name) > OUFS_MAX_NAME_LENGTH) {
+      OUFS_TRACE_EVENT(TRACE_NAME_TOO_LONG, *child, strlen(directory_name));
+      return(-2);
     }
 
     INODE inode;
@@ -298,9 +873,7 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERE
     *child = *parent;
     *parent = grandparent;
   }
-  if(debug) {
-    fprintf(stderr, "\tDEBUG: Found: %d, %d\n", *parent, *child);
-  }
+  OUFS_TRACE_EVENT(TRACE_FIND_FILE, *parent, *child);
 
   // Success!
   return(0);
@@ -331,6 +904,8 @@ int oufs_find_open_bit(unsigned char value)
  *  Allocate a new directory (an inode and block to contain the directory).  This
  *  includes initialization of the new directory.
  *
+ * - The new directory is not entered into its parent: see oufs_directory_insert()
+ *
  * @param parent_reference The inode of the parent directory
  * @return The inode reference of the new directory
  *         UNALLOCATED_INODE if we cannot allocate the directory
@@ -346,12 +921,11 @@ int oufs_allocate_new_directory(INODE_REFERENCE parent_reference)
   }
 
   INODE child;
-  INODE parent;
   INODE_REFERENCE openInode;
-  BLOCK_REFERENCE newBlockRef = block.content.master.unallocated_front;
-
-  virtual_disk_read_block(newBlockRef, &block2);
-  block.content.master.unallocated_front = block2.next_block;
+  BLOCK_REFERENCE newBlockRef = oufs_allocate_new_block(&block, &block2);
+  if (newBlockRef == UNALLOCATED_BLOCK) {
+    return (UNALLOCATED_INODE);
+  }
 
   int index = 0;
   int bit = -1;
@@ -360,7 +934,7 @@ int oufs_allocate_new_directory(INODE_REFERENCE parent_reference)
     if (bit != -1) {
       index = i;
       openInode = index*8 + (7 - bit % 8);
-      block.content.master.inode_allocated_flag[i] += (1 << bit);
+      oufs_mark_inode(&block, openInode, 1);
       break;
     }
   }
@@ -369,11 +943,9 @@ int oufs_allocate_new_directory(INODE_REFERENCE parent_reference)
     return (UNALLOCATED_INODE);
   }
 
-  //Read parent and child inodes
-  oufs_read_inode_by_reference(parent_reference, &parent);
+  //Read the child inode: the caller adds it to the parent
   oufs_read_inode_by_reference(openInode, &child);
   child.content = newBlockRef;
-  parent.size = parent.size + 1;
   
   //Initialize blocks and inodes
   oufs_init_directory_structures(&child, &block2, newBlockRef, openInode, parent_reference);
@@ -383,7 +955,6 @@ int oufs_allocate_new_directory(INODE_REFERENCE parent_reference)
   virtual_disk_write_block(newBlockRef, &block2);
   
   oufs_write_inode_by_reference(openInode, &child);
-  oufs_write_inode_by_reference(parent_reference, &parent);
 
   //Return new inode reference
   return openInode;
@@ -403,40 +974,33 @@ int oufs_allocate_new_directory(INODE_REFERENCE parent_reference)
 INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *local_name)
 {
   // Does the parent have a slot?
-  INODE inode;
+  OUDIR dir;
 
-  // Read the parent inode
-  if(oufs_read_inode_by_reference(parent, &inode) != 0) {
+  // Read the parent directory
+  if(oufs_directory_load(parent, NULL, &dir) != 0) {
     return UNALLOCATED_INODE;
   }
 
   // Is the parent full?
-  if(inode.size == N_DIRECTORY_ENTRIES_PER_BLOCK) {
+  if(dir.n_entries == N_DIRECTORY_ENTRIES_PER_BLOCK) {
     // Directory is full
     fprintf(stderr, "Parent directory is full.\n");
     return UNALLOCATED_INODE;
   }
 
-  // TODO
-
   //----------------------------------
   BLOCK block;
-  BLOCK pBlock;
   INODE child;
   INODE_REFERENCE inode_reference;
 
   //Read master block for inode table lookup
   virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &block);
-  virtual_disk_read_block(inode.content, &pBlock);
 
-  int index = 0;
   int bit = -1;
   for (int i = 0; i < N_INODES >> 3; i++) {
     bit = oufs_find_open_bit(block.content.master.inode_allocated_flag[i]);
     if (bit != -1) {
-      index = i;
-      inode_reference = index*8 + (7 - bit % 8);
-      block.content.master.inode_allocated_flag[i] += (1 << bit);
+      inode_reference = i*8 + (7 - bit % 8);
       break;
     }
   }
@@ -445,31 +1009,22 @@ INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *local_name)
     return UNALLOCATED_INODE;
   }
 
-  //Set parent size + 1
-  inode.size = inode.size + 1;
-  
-  //Initialize blocks and inodes
-  child.type = FILE_TYPE;
-  child.n_references = 1;
-  child.size = 0;
-  child.content = UNALLOCATED_BLOCK;
-
-  //Place inode into parent block and call it (local_name)
-  for (int i = 0; i < N_DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-    if (pBlock.content.directory.entry[i].inode_reference == UNALLOCATED_INODE) {
-      DIRECTORY_ENTRY dirEn;
-      dirEn.inode_reference = inode_reference;
-      strcpy(dirEn.name, local_name);
-      pBlock.content.directory.entry[i] = dirEn;
-      break;
-    }
+  //Place inode into parent directory and call it (local_name)
+  if (oufs_directory_insert(&dir, local_name, inode_reference, FILE_TYPE) < 0 ||
+      oufs_directory_write(&dir) != 0) {
+    fprintf(stderr, "Cannot add %s to the parent directory.\n", local_name);
+    return UNALLOCATED_INODE;
   }
 
+  //Initialize blocks and inodes.  The master block is read again, as
+  // writing the directory may have given blocks to its name heap
+  oufs_set_inode(&child, FILE_TYPE, 1, UNALLOCATED_BLOCK, 0);
+  virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &block);
+  oufs_mark_inode(&block, inode_reference, 1);
+
   //Write all the data into the inodes and blocks
   virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &block);
   oufs_write_inode_by_reference(inode_reference, &child);
-  virtual_disk_write_block(inode.content, &pBlock);
-  oufs_write_inode_by_reference(parent, &inode);
   
   //----------------------------------
 
@@ -481,8 +1036,14 @@ INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *local_name)
  * Deallocate all of the blocks that are being used by an inode
  *
  * - Modifies the inode to set content to UNALLOCATED_BLOCK
- * - Adds any content blocks to the end of the free block list
- *    (these are added in the same order as they are in the file)
+ * - Content blocks are marked as free in the master block, which is
+ *    written once.  The blocks themselves are not written (the allocator
+ *    zeroes blocks when it hands them out again), but are discarded on
+ *    the host; only the links of a chained file are read, in runs of
+ *    consecutive blocks
+ * - Blocks shared with a clone just lose one sharer
+ * - Inline data slots are returned to the free inode pool
+ * - Indexed (sparse) files also give back their index block
  * - If the file is using no blocks, then return success without
  *    modifications.
  * - Note: the inode is not written back to the disk (we will let
@@ -496,7 +1057,7 @@ INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *local_name)
 int oufs_deallocate_blocks(INODE *inode)
 {
   BLOCK master_block;
-  BLOCK block;
+  BLOCK_REFERENCE refs[MAX_BLOCKS_IN_FILE];
 
   // Nothing to do if the inode has no content
   if(inode->content == UNALLOCATED_BLOCK)
@@ -508,22 +1069,42 @@ int oufs_deallocate_blocks(INODE *inode)
 
   if (virtual_disk_read_block(MASTER_BLOCK_REFERENCE, &master_block) != 0)
     return(-1);
-  
-  int n_data_blocks = (inode->size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
-  BLOCK_REFERENCE br = inode->content;
+
+  // Inline data: just give the inode slots back
+  if (inode->flags & INODE_INLINE_DATA) {
+    oufs_release_inline_data(&master_block, inode);
+    virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master_block);
+    inode->size = 0;
+    return(0);
+  }
+
+  int n_data_blocks = oufs_load_block_map(inode, refs);
+  if (n_data_blocks < 0)
+    return(-1);
+
+  // Clones share whole chains, so the first block tells us about all of them
+  int shared = !(inode->flags & INODE_INDEXED) &&
+    master_block.content.master.block_shares[inode->content] > 0;
+
   for (int i = 0; i < n_data_blocks; i++) {
-    virtual_disk_read_block(br, &block);
-    memset(block.content.data.data, 0, sizeof(block.content.data.data));
-    virtual_disk_write_block(br, &block);
-    if (block.next_block != UNALLOCATED_BLOCK)
-      br = block.next_block;
-  }
-  virtual_disk_read_block(master_block.content.master.unallocated_end, &block);
-  block.next_block = inode->content;
-  virtual_disk_write_block(master_block.content.master.unallocated_end, &block);
-  master_block.content.master.unallocated_end = br;
+    if (refs[i] == UNALLOCATED_BLOCK)
+      continue;
+    if (shared)
+      --master_block.content.master.block_shares[refs[i]];
+    else
+      oufs_deallocate_block(&master_block, refs[i]);
+  }
+  if (inode->flags & INODE_INDEXED)
+    oufs_deallocate_block(&master_block, inode->content);
   virtual_disk_write_block(MASTER_BLOCK_REFERENCE, &master_block);
 
+  // Give the space back to the host
+  if (!shared)
+    oufs_discard_blocks(refs, n_data_blocks);
+  if (inode->flags & INODE_INDEXED)
+    oufs_discard_blocks(&inode->content, 1);
+
+  inode->flags &= ~INODE_INDEXED;
   inode->content = UNALLOCATED_BLOCK;
   inode->size = 0;
 
@@ -533,12 +1114,16 @@ int oufs_deallocate_blocks(INODE *inode)
 
 /**
  * Allocate a new data block
- * - If one is found, then the free block linked list is updated
+ * - The lowest-numbered free block is used, and is marked as allocated in
+ *    the master block
+ * - Freed blocks keep their old contents on the disk, so the new block is
+ *    not read: the caller gets a zeroed buffer instead
  *
  * @param master_block A link to a buffer ALREADY containing the data from the master block.
  *    This buffer may be modified (but will not be written to the disk; we will let
  *    the calling function handle this).
- * @param new_block A link to a buffer into which the new block will be read.
+ * @param new_block A link to a buffer that is zeroed (next_block is
+ *    UNALLOCATED_BLOCK).
  *
  * @return The index of the allocated data block.  If no blocks are available,
  *        then UNALLOCATED_BLOCK is returned
@@ -546,21 +1131,362 @@ int oufs_deallocate_blocks(INODE *inode)
  */
 BLOCK_REFERENCE oufs_allocate_new_block(BLOCK *master_block, BLOCK *new_block)
 {
+  BLOCK_REFERENCE block_reference;
+
   // Is there an available block?
-  if(master_block->content.master.unallocated_front == UNALLOCATED_BLOCK) {
+  if(oufs_allocate_blocks(master_block, UNALLOCATED_BLOCK, 1, &block_reference) != 0) {
     // Did not find an available block
-    if(debug)
-      fprintf(stderr, "No blocks\n");
+    OUFS_TRACE_EVENT(TRACE_NO_BLOCKS, 1, 0);
     return(UNALLOCATED_BLOCK);
   }
 
-  // TODO
-  BLOCK_REFERENCE block_reference;
-  block_reference = master_block->content.master.unallocated_front;
-  virtual_disk_read_block(block_reference, new_block);
-  master_block->content.master.unallocated_front = new_block->next_block;
+  memset(new_block, 0, BLOCK_SIZE);
   new_block->next_block = UNALLOCATED_BLOCK;
 
   return(block_reference);
 }
 
+/**
+ * Is there a run of n free blocks starting at first?
+ */
+static int blocks_are_free(BLOCK *master_block, int first, int n)
+{
+  if(first < 0 || first + n > N_BLOCKS)
+    return(0);
+  for(int i = first; i < first + n; ++i)
+    if(block_is_allocated(master_block, i))
+      return(0);
+  return(1);
+}
+
+/**
+ * Allocate several data blocks at once, as one run of consecutive blocks
+ * if possible
+ * - A run that starts at goal is preferred (so that a file can keep
+ *    growing in place); otherwise the best-fitting free run is used
+ * - If there is no such run, the lowest-numbered free blocks are used
+ * - The blocks are only marked as allocated; they are not read or written
+ *    (and still hold whatever they held when they were freed)
+ *
+ * @param master_block A link to a buffer ALREADY containing the master block.
+ *    This buffer is modified, but not written to the disk.
+ * @param goal Preferred first block (UNALLOCATED_BLOCK if none)
+ * @param n_blocks Number of blocks to allocate
+ * @param refs Filled in with the references of the new blocks
+ * @return 0 if success
+ *         -1 if there are not enough free blocks (nothing is modified)
+ */
+int oufs_allocate_blocks(BLOCK *master_block, BLOCK_REFERENCE goal, int n_blocks,
+			 BLOCK_REFERENCE *refs)
+{
+  int start = -1;
+
+  if(n_blocks <= 0)
+    return(0);
+
+  // Contiguous run: at the goal, or else the smallest free run that is
+  //  long enough (best fit keeps the long runs for large files)
+  if(goal != UNALLOCATED_BLOCK && blocks_are_free(master_block, goal, n_blocks)) {
+    start = goal;
+  }else{
+    int best = N_BLOCKS + 1;
+    for(int i = 0, run = 0; i <= N_BLOCKS; ++i) {
+      if(i < N_BLOCKS && !block_is_allocated(master_block, i)) {
+	++run;
+      }else{
+	if(run >= n_blocks && run < best) {
+	  best = run;
+	  start = i - run;
+	}
+	run = 0;
+      }
+    }
+  }
+
+  if(start >= 0) {
+    for(int k = 0; k < n_blocks; ++k)
+      refs[k] = start + k;
+  }else{
+    // Fragmented free space: take the lowest free blocks
+    int k = 0;
+    for(int i = 0; i < N_BLOCKS && k < n_blocks; ++i)
+      if(!block_is_allocated(master_block, i))
+	refs[k++] = i;
+    if(k < n_blocks)
+      return(-1);
+  }
+
+  for(int k = 0; k < n_blocks; ++k)
+    set_block_bits(master_block, refs[k], 1, 1);
+  OUFS_TRACE_EVENT(TRACE_BLOCKS_ALLOCATE, refs[0], n_blocks);
+  return(0);
+}
+
+/**
+ * Load the block map of a file: the reference of each of its data blocks,
+ * in file order
+ * - Chained files: the chain is followed, reading it in runs of
+ *    consecutive blocks
+ * - Indexed files: the index block is read (holes are UNALLOCATED_BLOCK)
+ * - Files with inline data or no data have no blocks
+ *
+ * @param inode Pointer to a loaded file inode
+ * @param refs Array of at least MAX_BLOCKS_IN_FILE entries to fill in
+ * @return The number of data blocks in the file
+ *         -x if error
+ */
+int oufs_load_block_map(INODE *inode, BLOCK_REFERENCE *refs)
+{
+  BLOCK block;
+  int n_data_blocks = MIN((inode->size + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE,
+			  MAX_BLOCKS_IN_FILE);
+
+  if((inode->flags & INODE_INLINE_DATA) || inode->content == UNALLOCATED_BLOCK)
+    return(0);
+
+  if(inode->flags & INODE_INDEXED) {
+    if(virtual_disk_read_block(inode->content, &block) != 0)
+      return(-1);
+    memcpy(refs, block.content.index.block, n_data_blocks * sizeof(BLOCK_REFERENCE));
+    return(n_data_blocks);
+  }
+
+  BLOCK_REFERENCE br = inode->content;
+  for(int i = 0; i < n_data_blocks; ++i) {
+    if(br == UNALLOCATED_BLOCK)
+      return(-1);
+    if(!virtual_disk_block_is_cached(br))
+      virtual_disk_prefetch_blocks(br, n_data_blocks - i);
+    if(virtual_disk_read_block(br, &block) != 0)
+      return(-1);
+    refs[i] = br;
+    br = block.next_block;
+  }
+  return(n_data_blocks);
+}
+
+/**
+ * Worker for oufs_copy_blocks(): blocks is a buffer of n_blocks blocks
+ */
+static int copy_blocks_through(BLOCK *blocks, BLOCK *master_block, BLOCK_REFERENCE *src_refs,
+			       int n_blocks, BLOCK_REFERENCE *dst_refs)
+{
+  // Read the source blocks, in runs where they are consecutive
+  for(int i = 0; i < n_blocks; ++i) {
+    if(src_refs[i] == UNALLOCATED_BLOCK)
+      continue;
+    if(!virtual_disk_block_is_cached(src_refs[i])) {
+      int j;
+      for(j = i + 1; j < n_blocks && src_refs[j] == src_refs[j - 1] + 1; ++j)
+	;
+      virtual_disk_prefetch_blocks(src_refs[i], j - i);
+    }
+    if(virtual_disk_read_block(src_refs[i], &blocks[i]) != 0)
+      return(-1);
+  }
+
+  // Allocate the copies, as one run if possible (holes stay holes)
+  BLOCK_REFERENCE new_refs[MAX_BLOCKS_IN_FILE];
+  int n_new = 0;
+  for(int i = 0; i < n_blocks; ++i)
+    if(src_refs[i] != UNALLOCATED_BLOCK)
+      ++n_new;
+  if(oufs_allocate_blocks(master_block, UNALLOCATED_BLOCK, n_new, new_refs) != 0) {
+    fprintf(stderr, "copy_blocks: out of blocks\n");
+    return(-2);
+  }
+  for(int i = 0, k = 0; i < n_blocks; ++i)
+    dst_refs[i] = (src_refs[i] == UNALLOCATED_BLOCK) ? UNALLOCATED_BLOCK : new_refs[k++];
+
+  // Relink them and write them out in runs
+  for(int i = 0; i < n_blocks; ++i)
+    blocks[i].next_block = (i + 1 < n_blocks) ? dst_refs[i + 1] : UNALLOCATED_BLOCK;
+  for(int i = 0, j; i < n_blocks; i = j) {
+    for(j = i + 1; j < n_blocks && dst_refs[i] != UNALLOCATED_BLOCK &&
+	  dst_refs[j] == dst_refs[j - 1] + 1; ++j)
+      ;
+    if(dst_refs[i] != UNALLOCATED_BLOCK &&
+       virtual_disk_write_blocks(dst_refs[i], j - i, &blocks[i]) != 0)
+      return(-3);
+  }
+
+  return(0);
+}
+
+/**
+ * Copy a list of blocks into newly allocated blocks
+ * - The source blocks are read in runs of consecutive blocks
+ * - The copies are linked to each other in list order (the last one to
+ *    nowhere) and are written in runs of consecutive blocks
+ * - UNALLOCATED_BLOCK entries (holes) are not copied
+ *
+ * @param master_block A link to a buffer ALREADY containing the master block.
+ *    New blocks are allocated here, but it is not written to the disk.  If
+ *    an error is returned, the caller must discard it.
+ * @param src_refs References of the blocks to copy (e.g., a file's block map)
+ * @param n_blocks Number of blocks to copy
+ * @param dst_refs Filled in with the references of the new blocks
+ * @return 0 if success
+ *         -x if error
+ */
+int oufs_copy_blocks(BLOCK *master_block, BLOCK_REFERENCE *src_refs, int n_blocks,
+		     BLOCK_REFERENCE *dst_refs)
+{
+  if(n_blocks <= 0)
+    return(0);
+
+  BLOCK *blocks = malloc(n_blocks * sizeof(BLOCK));
+  if(blocks == NULL)
+    return(-1);
+
+  int ret = copy_blocks_through(blocks, master_block, src_refs, n_blocks, dst_refs);
+  free(blocks);
+  return(ret);
+}
+
+/**
+ * Give a file a private copy of data blocks that it shares with clones
+ * - Because blocks are chained, the whole chain is copied
+ * - The old blocks lose one sharer
+ * - Note: neither the master block nor the inode is written back to the
+ *    disk (we will let the calling function handle this)
+ *
+ * @param master_block A link to a buffer ALREADY containing the master block
+ * @param inode A pointer to the file's inode; its content is updated
+ * @param block_references Filled in with the references of the new blocks
+ * @return 0 if success (or if nothing was shared)
+ *         -x if error (the master block must then be discarded)
+ */
+int oufs_unshare_blocks(BLOCK *master_block, INODE *inode, BLOCK_REFERENCE *block_references)
+{
+  BLOCK_REFERENCE src_refs[MAX_BLOCKS_IN_FILE];
+
+  if(inode->content == UNALLOCATED_BLOCK || (inode->flags & (INODE_INLINE_DATA | INODE_INDEXED)) ||
+     master_block->content.master.block_shares[inode->content] == 0)
+    return(0);
+
+  int n_data_blocks = oufs_load_block_map(inode, src_refs);
+  if(n_data_blocks < 0 ||
+     oufs_copy_blocks(master_block, src_refs, n_data_blocks, block_references) != 0)
+    return(-1);
+
+  for(int i = 0; i < n_data_blocks; ++i)
+    --master_block->content.master.block_shares[src_refs[i]];
+  inode->content = block_references[0];
+
+  return(0);
+}
+
+/**
+ * Given an inode reference, read the inode and (for a file with inline
+ * data) its contents from the virtual disk.  Inline data is stored in the
+ * same inode block, so this is a single block read.
+ *
+ * @param i Inode reference (index into the inode list)
+ * @param inode Pointer to an inode memory structure to fill in
+ * @param data Buffer of at least OUFS_INLINE_DATA_SIZE bytes; receives the
+ *          inline data (if any)
+ * @return 0 = successfully loaded the inode
+ *         -1 = an error has occurred
+ */
+int oufs_read_inline_data(INODE_REFERENCE i, INODE *inode, unsigned char *data)
+{
+  OUFS_TRACE_EVENT(TRACE_INODE_READ_INLINE, i, 0);
+
+  BLOCK b;
+  if(virtual_disk_read_block(i / N_INODES_PER_BLOCK + 1, &b) != 0)
+    return(-1);
+
+  *inode = b.content.inodes.inode[i % N_INODES_PER_BLOCK];
+  if(inode->flags & INODE_INLINE_DATA)
+    memcpy(data, &b.content.inodes.inode[inode->content % N_INODES_PER_BLOCK],
+	   MIN(inode->size, OUFS_INLINE_DATA_SIZE));
+
+  return(0);
+}
+
+/**
+ * Number of inode slots needed to hold size bytes of inline data
+ */
+static int inline_slots(int size)
+{
+  return((size + sizeof(INODE) - 1) / sizeof(INODE));
+}
+
+/**
+ * Return the inode slots holding an inode's inline data to the free pool
+ * - Modifies the in-memory copies of the master block and the inode
+ *    (the inode no longer has inline data or content; size is unchanged)
+ *
+ * @param master_block A link to a buffer ALREADY containing the master block
+ * @param inode A pointer to an inode with inline data
+ */
+void oufs_release_inline_data(BLOCK *master_block, INODE *inode)
+{
+  if(!(inode->flags & INODE_INLINE_DATA))
+    return;
+
+  set_inode_bits(master_block, inode->content, inline_slots(inode->size), 0);
+  inode->flags &= ~INODE_INLINE_DATA;
+  inode->content = UNALLOCATED_BLOCK;
+}
+
+/**
+ * Store the complete contents of a small file inline, next to its inode
+ * - A run of free inode slots is found in the inode's own block (the slots
+ *    that currently hold the file's inline data count as free)
+ * - The inode and its data are written with a single block write
+ * - The master block is modified in memory, but not written to the disk
+ *
+ * @param master_block A link to a buffer ALREADY containing the master block
+ * @param i Reference of the file's inode
+ * @param inode A pointer to the file's inode; flags, content and size are
+ *          updated
+ * @param data The new contents of the file
+ * @param size Number of bytes in data (1 ... OUFS_INLINE_DATA_SIZE)
+ * @return 0 if success
+ *         -1 if there is no room for the data (nothing is modified)
+ */
+int oufs_write_inline_data(BLOCK *master_block, INODE_REFERENCE i, INODE *inode,
+			   unsigned char *data, int size)
+{
+  BLOCK b;
+  BLOCK master = *master_block;
+  int n = inline_slots(size);
+
+  if(size <= 0 || size > OUFS_INLINE_DATA_SIZE)
+    return(-1);
+
+  // Candidate slots: the inode block that holds inode i
+  int first = (i / N_INODES_PER_BLOCK) * N_INODES_PER_BLOCK;
+  int last = MIN(first + N_INODES_PER_BLOCK, N_INODES);
+  INODE old = *inode;
+  oufs_release_inline_data(&master, &old);
+
+  // First fit
+  int start = -1;
+  for(int j = first, run = 0; j < last && start < 0; ++j) {
+    if(inode_is_allocated(&master, j))
+      run = 0;
+    else if(++run == n)
+      start = j - n + 1;
+  }
+  if(start < 0)
+    return(-1);
+
+  if(virtual_disk_read_block(i / N_INODES_PER_BLOCK + 1, &b) != 0)
+    return(-1);
+
+  set_inode_bits(&master, start, n, 1);
+  inode->flags |= INODE_INLINE_DATA;
+  inode->content = start;
+  inode->size = size;
+  b.content.inodes.inode[i % N_INODES_PER_BLOCK] = *inode;
+  memcpy(&b.content.inodes.inode[start % N_INODES_PER_BLOCK], data, size);
+
+  if(virtual_disk_write_block(i / N_INODES_PER_BLOCK + 1, &b) != 0)
+    return(-1);
+
+  *master_block = master;
+  return(0);
+}
@@ -17,8 +17,21 @@ int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent,
 		   INODE_REFERENCE *child, char *local_name);
  
 int oufs_deallocate_block(BLOCK *master_block, BLOCK_REFERENCE block_reference);
+void oufs_mark_inode(BLOCK *master_block, INODE_REFERENCE i, int allocated);
+void oufs_count_free(BLOCK *master_block);
+int oufs_check_format();
 
 int oufs_allocate_new_directory(INODE_REFERENCE parent_reference);
+
+// Directories in memory: sorted entries and long names
+int oufs_directory_load(INODE_REFERENCE inode_reference, INODE *inode, OUDIR *dp);
+int oufs_directory_get_name(OUDIR *dp, int i, char *name);
+int oufs_directory_lookup(OUDIR *dp, char *name);
+int oufs_directory_search(OUDIR *dp, char *name);
+int oufs_directory_insert(OUDIR *dp, char *name, INODE_REFERENCE inode_reference,
+			  INODE_TYPE type);
+int oufs_directory_remove(OUDIR *dp, char *name);
+int oufs_directory_write(OUDIR *dp);
 int oufs_find_open_bit(unsigned char value);
 
 
@@ -26,5 +39,21 @@ int oufs_find_open_bit(unsigned char value);
 INODE_REFERENCE oufs_create_file(INODE_REFERENCE parent, char *local_name);
 int oufs_deallocate_blocks(INODE *inode);
 BLOCK_REFERENCE oufs_allocate_new_block(BLOCK *master_block, BLOCK *new_block);
+int oufs_allocate_blocks(BLOCK *master_block, BLOCK_REFERENCE goal, int n_blocks,
+			 BLOCK_REFERENCE *refs);
+void oufs_discard_blocks(BLOCK_REFERENCE *refs, int n_blocks);
+int oufs_discard_free_blocks(BLOCK *master_block);
+
+// Inline data for small files
+int oufs_read_inline_data(INODE_REFERENCE i, INODE *inode, unsigned char *data);
+int oufs_write_inline_data(BLOCK *master_block, INODE_REFERENCE i, INODE *inode,
+			   unsigned char *data, int size);
+void oufs_release_inline_data(BLOCK *master_block, INODE *inode);
+
+// Block maps, block copying and copy-on-write sharing
+int oufs_load_block_map(INODE *inode, BLOCK_REFERENCE *refs);
+int oufs_copy_blocks(BLOCK *master_block, BLOCK_REFERENCE *src_refs, int n_blocks,
+		     BLOCK_REFERENCE *dst_refs);
+int oufs_unshare_blocks(BLOCK *master_block, INODE *inode, BLOCK_REFERENCE *block_references);
 
 #endif
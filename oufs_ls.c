@@ -15,12 +15,20 @@ int main(int argc, char** argv) {
   // Open the virtual disk
   virtual_disk_attach(disk_name, pipe_name_base);
 
+  // Optional prefix: only list the names that start with it
+  char *prefix = "";
+  if(argc >= 3 && strcmp(argv[1], "-p") == 0) {
+    prefix = argv[2];
+    argv += 2;
+    argc -= 2;
+  }
+
   if(argc == 1) {
-    oufs_list(cwd, "");
+    oufs_list_prefix(cwd, "", prefix);
   }else if(argc == 2){
-    oufs_list(cwd, argv[1]);
+    oufs_list_prefix(cwd, argv[1], prefix);
   }else{
-    fprintf(stderr, "Usage: oufs_ls [<name>]\n");
+    fprintf(stderr, "Usage: oufs_ls [-p <prefix>] [<name>]\n");
   }
 
   // Clean up
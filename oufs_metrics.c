@@ -0,0 +1,303 @@
+/**
+ *  oufs_metrics.c
+ *
+ *  Call counts, block I/O and latency histograms for the public calls of
+ *  the library.
+ *
+ *  Each measured call costs two clock reads and a few additions.  The
+ *  library is single-threaded (the block cache and the open files are not
+ *  locked), so there is one table of counters.
+ *
+ *  If the environment variable OUFS_METRICS names a file, the counters of
+ *  each program are added to that file when it exits, so that the
+ *  measurements of many runs of the oufs tools can be read back with
+ *  oufs_stats.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+#include "virtual_disk.h"
+#include "oufs_metrics.h"
+
+// Names of the operations, in OUFS_OP order
+static const char *op_names[OUFS_N_OPS] = {
+  "oufs_format_disk", "oufs_trim", "oufs_statfs", "oufs_find_file",
+  "oufs_list", "oufs_list_prefix", "oufs_opendir", "oufs_readdir",
+  "oufs_seekdir", "oufs_closedir", "oufs_mkdir", "oufs_rmdir",
+  "oufs_fopen", "oufs_fopen_hint", "oufs_fclose", "oufs_fallocate",
+  "oufs_fwrite", "oufs_fwritev", "oufs_fflush", "oufs_fread",
+  "oufs_freadv", "oufs_fread_views", "oufs_release_views", "oufs_fseek",
+  "oufs_fpunch", "oufs_copy_file", "oufs_remove", "oufs_link",
+  "oufs_rename", "oufs_check", "oufs_fragmentation", "oufs_defrag"
+};
+
+// Header of a metrics file
+#define METRICS_MAGIC "OUFSMETR"
+typedef struct
+{
+  char magic[8];
+  int n_ops;
+  int n_buckets;
+} METRICS_HEADER;
+
+static OUFS_METRICS metrics;
+
+// Has the exit handler been set up (or found not to be needed)?
+static int exit_checked = 0;
+
+/**
+ * Monotonic clock, in nanoseconds
+ */
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/**
+ * atexit() handler: add this program's counters to the OUFS_METRICS file
+ */
+static void save_at_exit()
+{
+  char *path = getenv("OUFS_METRICS");
+  if(path != NULL && path[0] != '\0')
+    oufs_metrics_save(path);
+}
+
+/**
+ * Start measuring a call
+ *
+ * @param op The operation
+ * @return The state of the measurement, for oufs_op_end()
+ */
+OUFS_OP_TIMER oufs_op_begin(OUFS_OP op)
+{
+  OUFS_OP_TIMER timer;
+  VDISK_COUNTERS io;
+
+  if(!exit_checked) {
+    exit_checked = 1;
+    if(getenv("OUFS_METRICS") != NULL)
+      atexit(save_at_exit);
+  }
+
+  virtual_disk_get_counters(&io);
+  timer.op = op;
+  timer.caller = virtual_disk_set_caller(op);
+  timer.n_reads = io.n_reads;
+  timer.n_writes = io.n_writes;
+  timer.n_cache_hits = io.n_cache_hits;
+  timer.start_ns = now_ns();
+  return(timer);
+}
+
+/**
+ * Finish measuring a call, and add it to the counters of its operation
+ *
+ * @param timer The state returned by oufs_op_begin()
+ */
+void oufs_op_end(OUFS_OP_TIMER *timer)
+{
+  unsigned long long ns = now_ns() - timer->start_ns;
+  OUFS_OP_METRICS *m = &metrics.op[timer->op];
+  VDISK_COUNTERS io;
+
+  virtual_disk_get_counters(&io);
+  virtual_disk_set_caller(timer->caller);
+  ++m->n_calls;
+  m->n_reads += io.n_reads - timer->n_reads;
+  m->n_writes += io.n_writes - timer->n_writes;
+  m->n_cache_hits += io.n_cache_hits - timer->n_cache_hits;
+  m->total_ns += ns;
+
+  // Bucket: position of the highest set bit
+  int bucket = 0;
+  while(ns > 1 && bucket < OUFS_N_LATENCY_BUCKETS - 1) {
+    ns >>= 1;
+    ++bucket;
+  }
+  ++m->latency[bucket];
+}
+
+/**
+ * Name of an operation (the name of the library call)
+ */
+const char *oufs_op_name(OUFS_OP op)
+{
+  if(op < 0 || op >= OUFS_N_OPS)
+    return("unknown");
+  return(op_names[op]);
+}
+
+/**
+ * Copy out the counters of this program
+ *
+ * @param m Filled in with the counters
+ */
+void oufs_metrics_get(OUFS_METRICS *m)
+{
+  *m = metrics;
+}
+
+/**
+ * Clear the counters of this program
+ */
+void oufs_metrics_reset()
+{
+  memset(&metrics, 0, sizeof(OUFS_METRICS));
+}
+
+/**
+ * Read the counters saved in a metrics file
+ *
+ * @param path Name of the metrics file
+ * @param m Filled in with the counters (all zero if the file does not exist)
+ * @return 0 if success
+ *         -1 if the file cannot be read or is not a metrics file
+ */
+int oufs_metrics_load(char *path, OUFS_METRICS *m)
+{
+  METRICS_HEADER header;
+
+  memset(m, 0, sizeof(OUFS_METRICS));
+  int fd = open(path, O_RDONLY);
+  if(fd < 0)
+    return(0);
+
+  flock(fd, LOCK_SH);
+  int ret = 0;
+  ssize_t n = read(fd, &header, sizeof(header));
+  if(n == 0) {
+    // Empty file: no counters yet
+  }else if(n != sizeof(header) || memcmp(header.magic, METRICS_MAGIC, 8) != 0 ||
+	   header.n_ops != OUFS_N_OPS || header.n_buckets != OUFS_N_LATENCY_BUCKETS ||
+	   read(fd, m, sizeof(OUFS_METRICS)) != sizeof(OUFS_METRICS)) {
+    memset(m, 0, sizeof(OUFS_METRICS));
+    ret = -1;
+  }
+  close(fd);
+  return(ret);
+}
+
+/**
+ * Add the counters of this program to a metrics file (which is created if
+ *   needed).  The file is locked while it is updated, so programs that
+ *   exit at the same time do not lose each other's counters.
+ *
+ * @param path Name of the metrics file
+ * @return 0 if success
+ *         -1 if the file cannot be updated
+ */
+int oufs_metrics_save(char *path)
+{
+  METRICS_HEADER header;
+  OUFS_METRICS total;
+
+  int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(fd < 0)
+    return(-1);
+  flock(fd, LOCK_EX);
+
+  // Add in what the file holds already (a damaged file is started over)
+  memset(&total, 0, sizeof(OUFS_METRICS));
+  if(read(fd, &header, sizeof(header)) != sizeof(header) ||
+     memcmp(header.magic, METRICS_MAGIC, 8) != 0 ||
+     header.n_ops != OUFS_N_OPS || header.n_buckets != OUFS_N_LATENCY_BUCKETS ||
+     read(fd, &total, sizeof(OUFS_METRICS)) != sizeof(OUFS_METRICS))
+    memset(&total, 0, sizeof(OUFS_METRICS));
+
+  for(int i = 0; i < OUFS_N_OPS; ++i) {
+    OUFS_OP_METRICS *t = &total.op[i];
+    OUFS_OP_METRICS *m = &metrics.op[i];
+    t->n_calls += m->n_calls;
+    t->n_reads += m->n_reads;
+    t->n_writes += m->n_writes;
+    t->n_cache_hits += m->n_cache_hits;
+    t->total_ns += m->total_ns;
+    for(int b = 0; b < OUFS_N_LATENCY_BUCKETS; ++b)
+      t->latency[b] += m->latency[b];
+  }
+
+  memcpy(header.magic, METRICS_MAGIC, 8);
+  header.n_ops = OUFS_N_OPS;
+  header.n_buckets = OUFS_N_LATENCY_BUCKETS;
+  int ret = (pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+	     pwrite(fd, &total, sizeof(total), sizeof(header)) == sizeof(total)) ? 0 : -1;
+  close(fd);
+  return(ret);
+}
+
+/**
+ * Upper bound (in ns) of the latency below which a fraction of the calls
+ *   fall, to the resolution of the histogram
+ */
+static unsigned long long percentile_ns(OUFS_OP_METRICS *m, double fraction)
+{
+  unsigned long seen = 0;
+  for(int b = 0; b < OUFS_N_LATENCY_BUCKETS; ++b) {
+    seen += m->latency[b];
+    if(seen >= fraction * m->n_calls)
+      return(2ULL << b);
+  }
+  return(2ULL << (OUFS_N_LATENCY_BUCKETS - 1));
+}
+
+/**
+ * Print a table of the operations that were called
+ *
+ * @param fp Where to print
+ * @param m The counters
+ */
+void oufs_metrics_print(FILE *fp, OUFS_METRICS *m)
+{
+  fprintf(fp, "%-20s %8s %8s %8s %8s %10s %10s %10s\n", "Operation", "Calls",
+	  "Reads", "Writes", "Hits", "Mean(us)", "p50(us)<=", "p99(us)<=");
+  for(int i = 0; i < OUFS_N_OPS; ++i) {
+    OUFS_OP_METRICS *op = &m->op[i];
+    if(op->n_calls == 0)
+      continue;
+    fprintf(fp, "%-20s %8lu %8lu %8lu %8lu %10.1f %10.1f %10.1f\n", op_names[i],
+	    op->n_calls, op->n_reads, op->n_writes, op->n_cache_hits,
+	    op->total_ns / 1000.0 / op->n_calls,
+	    percentile_ns(op, 0.5) / 1000.0, percentile_ns(op, 0.99) / 1000.0);
+  }
+}
+
+/**
+ * Print the counters of the operations that were called as one JSON object
+ *   ("latency_log2_ns"[k] counts the calls that took [2^k, 2^(k+1)) ns)
+ *
+ * @param fp Where to print
+ * @param m The counters
+ */
+void oufs_metrics_print_json(FILE *fp, OUFS_METRICS *m)
+{
+  int first = 1;
+
+  fprintf(fp, "{\"ops\": {");
+  for(int i = 0; i < OUFS_N_OPS; ++i) {
+    OUFS_OP_METRICS *op = &m->op[i];
+    if(op->n_calls == 0)
+      continue;
+    fprintf(fp, "%s\n  \"%s\": {\"calls\": %lu, \"block_reads\": %lu, \"block_writes\": %lu, "
+	    "\"cache_hits\": %lu, \"total_ns\": %llu, \"latency_log2_ns\": [",
+	    first ? "" : ",", op_names[i], op->n_calls, op->n_reads, op->n_writes,
+	    op->n_cache_hits, op->total_ns);
+
+    // Trailing empty buckets are left out
+    int last = OUFS_N_LATENCY_BUCKETS - 1;
+    while(last > 0 && op->latency[last] == 0)
+      --last;
+    for(int b = 0; b <= last; ++b)
+      fprintf(fp, "%s%lu", (b == 0) ? "" : ", ", op->latency[b]);
+    fprintf(fp, "]}");
+    first = 0;
+  }
+  fprintf(fp, "%s}}\n", first ? "" : "\n");
+}
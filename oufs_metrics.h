@@ -0,0 +1,92 @@
+#ifndef OUFS_METRICS_H
+#define OUFS_METRICS_H
+
+#include <stdio.h>
+
+// Operations that are measured: the public calls of the library
+typedef enum {
+  OUFS_OP_FORMAT_DISK = 0,
+  OUFS_OP_TRIM,
+  OUFS_OP_STATFS,
+  OUFS_OP_FIND_FILE,
+  OUFS_OP_LIST,
+  OUFS_OP_LIST_PREFIX,
+  OUFS_OP_OPENDIR,
+  OUFS_OP_READDIR,
+  OUFS_OP_SEEKDIR,
+  OUFS_OP_CLOSEDIR,
+  OUFS_OP_MKDIR,
+  OUFS_OP_RMDIR,
+  OUFS_OP_FOPEN,
+  OUFS_OP_FOPEN_HINT,
+  OUFS_OP_FCLOSE,
+  OUFS_OP_FALLOCATE,
+  OUFS_OP_FWRITE,
+  OUFS_OP_FWRITEV,
+  OUFS_OP_FFLUSH,
+  OUFS_OP_FREAD,
+  OUFS_OP_FREADV,
+  OUFS_OP_FREAD_VIEWS,
+  OUFS_OP_RELEASE_VIEWS,
+  OUFS_OP_FSEEK,
+  OUFS_OP_FPUNCH,
+  OUFS_OP_COPY_FILE,
+  OUFS_OP_REMOVE,
+  OUFS_OP_LINK,
+  OUFS_OP_RENAME,
+  OUFS_OP_CHECK,
+  OUFS_OP_FRAGMENTATION,
+  OUFS_OP_DEFRAG,
+  OUFS_N_OPS
+} OUFS_OP;
+
+// Latency histogram: bucket k counts the calls that took [2^k, 2^(k+1))
+//  nanoseconds (bucket 0 also counts calls under 1 ns)
+#define OUFS_N_LATENCY_BUCKETS 40
+
+// Measurements of one operation.  Block I/O includes the I/O of any
+//  measured operations that it calls
+typedef struct
+{
+  unsigned long n_calls;
+  unsigned long n_reads;
+  unsigned long n_writes;
+  unsigned long n_cache_hits;
+  unsigned long long total_ns;
+  unsigned long latency[OUFS_N_LATENCY_BUCKETS];
+} OUFS_OP_METRICS;
+
+typedef struct
+{
+  OUFS_OP_METRICS op[OUFS_N_OPS];
+} OUFS_METRICS;
+
+// State of one measured call, kept on the caller's stack
+typedef struct
+{
+  OUFS_OP op;
+  // Caller of the block requests before this call (virtual_disk_set_caller())
+  int caller;
+  unsigned long long start_ns;
+  unsigned long n_reads;
+  unsigned long n_writes;
+  unsigned long n_cache_hits;
+} OUFS_OP_TIMER;
+
+OUFS_OP_TIMER oufs_op_begin(OUFS_OP op);
+void oufs_op_end(OUFS_OP_TIMER *timer);
+
+// Measure the rest of the enclosing function as one call of op: the
+//  measurement ends whenever the function returns
+#define OUFS_MEASURE(op) \
+  OUFS_OP_TIMER oufs_op_timer __attribute__((cleanup(oufs_op_end))) = oufs_op_begin(op)
+
+const char *oufs_op_name(OUFS_OP op);
+void oufs_metrics_get(OUFS_METRICS *metrics);
+void oufs_metrics_reset();
+int oufs_metrics_load(char *path, OUFS_METRICS *metrics);
+int oufs_metrics_save(char *path);
+void oufs_metrics_print(FILE *fp, OUFS_METRICS *metrics);
+void oufs_metrics_print_json(FILE *fp, OUFS_METRICS *metrics);
+
+#endif
@@ -0,0 +1,60 @@
+/**
+Rename or move a file or directory in the OU File System.
+
+CS3113
+
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  char dst[MAX_PATH_LENGTH];
+  int ret;
+
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Check arguments
+  if(argc == 3) {
+    // Open the virtual disk
+    virtual_disk_attach(disk_name, pipe_name_base);
+
+    // Moving into an existing directory keeps the name
+    strncpy(dst, argv[2], MAX_PATH_LENGTH-1);
+    dst[MAX_PATH_LENGTH-1] = 0;
+    OUDIR *dp = oufs_opendir(cwd, argv[2]);
+    if(dp != NULL) {
+      oufs_closedir(dp);
+
+      // Last component of the source, ignoring any trailing /'s
+      char src[MAX_PATH_LENGTH];
+      strncpy(src, argv[1], MAX_PATH_LENGTH-1);
+      src[MAX_PATH_LENGTH-1] = 0;
+      int len = strlen(src);
+      while(len > 1 && src[len-1] == '/')
+	src[--len] = 0;
+      char *name = strrchr(src, '/');
+      name = (name == NULL) ? src : name + 1;
+
+      strncat(dst, "/", MAX_PATH_LENGTH-1-strlen(dst));
+      strncat(dst, name, MAX_PATH_LENGTH-1-strlen(dst));
+    }
+
+    ret = oufs_rename(cwd, argv[1], dst);
+
+    // Clean up
+    virtual_disk_detach();
+    
+  }else{
+    fprintf(stderr, "Usage: oufs_mv <src> <dst>\n");
+    return(-1);
+  }
+
+  return(ret == 0 ? 0 : 1);
+}
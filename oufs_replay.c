@@ -0,0 +1,351 @@
+/**
+ *  oufs_replay
+ *
+ *  Replays a block I/O trace captured with OUFS_IO_TRACE against a disk
+ *  image or a null backend, and reports what the requests cost.
+ *
+ *  Usage: oufs_replay [-n] [-w] [-t speed] [-j threads] [-c cache blocks]
+ *                     {trace} [image]
+ *
+ *  -n            Null backend: no I/O is done (the image is not needed)
+ *  -w            Really write the written blocks (as zeros) to the image;
+ *                  otherwise writes are only counted.  The trace holds no
+ *                  data, so only use -w on a copy of an image
+ *  -t speed      0 (default): as fast as possible; 1: with the captured
+ *                  timing; 2: twice as fast, etc.
+ *  -j threads    Number of threads issuing the requests (default 1).  The
+ *                  records are dealt out to the threads in turn
+ *  -c blocks     Size of the simulated block cache (default
+ *                  VDISK_CACHE_BLOCKS; 0 for none).  Like the virtual
+ *                  disk's cache, it is direct-mapped and write-through
+ *
+ *  The image is OUFS_DISK if it is not given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "oufs_lib.h"
+#include "oufs_metrics.h"
+#include "virtual_disk.h"
+
+// The trace, loaded into memory, with the time of each record (in us since
+//  the start of the first session)
+typedef struct
+{
+  int n_records;
+  VDISK_TRACE_RECORD *records;
+  unsigned long long *time;
+} TRACE;
+
+// Replay settings and results, shared by the threads
+typedef struct
+{
+  TRACE *trace;
+  int fd;
+  int write_blocks;
+  double speed;
+  int n_threads;
+  struct timespec start;
+
+  // Simulated cache: the block in each slot (UNALLOCATED_BLOCK if none)
+  int cache_blocks;
+  BLOCK_REFERENCE *cache;
+  pthread_mutex_t lock;
+
+  // Results
+  unsigned long n_reads;
+  unsigned long n_hits;
+  unsigned long n_prefetches;
+  unsigned long n_writes;
+  unsigned long n_discards;
+  unsigned long n_errors;
+} REPLAY;
+
+// Per-thread argument
+typedef struct
+{
+  REPLAY *replay;
+  int first;
+} WORKER;
+
+static const char *op_names[VDISK_TRACE_N_OPS] = {
+  "read", "write", "prefetch", "discard", "pin", "attach"
+};
+
+/**
+ * Load a trace file
+ *
+ * @param path Name of the trace file
+ * @param trace Filled in with the records
+ * @return 0 if success
+ *         -x if error
+ */
+static int trace_load(char *path, TRACE *trace)
+{
+  VDISK_TRACE_HEADER header;
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL) {
+    perror(path);
+    return(-1);
+  }
+  if(fread(&header, sizeof(header), 1, fp) != 1 ||
+     memcmp(header.magic, VDISK_TRACE_MAGIC, 8) != 0 ||
+     header.block_size != BLOCK_SIZE || header.n_blocks != N_BLOCKS) {
+    fprintf(stderr, "%s is not a block I/O trace of this disk layout\n", path);
+    fclose(fp);
+    return(-2);
+  }
+
+  fseek(fp, 0, SEEK_END);
+  long n = (ftell(fp) - (long) sizeof(header)) / sizeof(VDISK_TRACE_RECORD);
+  fseek(fp, sizeof(header), SEEK_SET);
+  trace->records = (VDISK_TRACE_RECORD *) malloc((n + 1) * sizeof(VDISK_TRACE_RECORD));
+  trace->time = (unsigned long long *) malloc((n + 1) * sizeof(unsigned long long));
+  if(trace->records == NULL || trace->time == NULL) {
+    fclose(fp);
+    return(-3);
+  }
+  trace->n_records = fread(trace->records, sizeof(VDISK_TRACE_RECORD), n, fp);
+  fclose(fp);
+
+  // Sessions are placed at their (whole second) start times
+  unsigned long long first_session = 0, session = 0;
+  for(int i = 0; i < trace->n_records; ++i) {
+    VDISK_TRACE_RECORD *r = &trace->records[i];
+    if(r->op == VDISK_TRACE_ATTACH) {
+      if(first_session == 0)
+	first_session = r->time;
+      session = (r->time - first_session) * 1000000ULL;
+      // Sessions never overlap, even when their start times are rounded
+      if(i > 0 && session < trace->time[i - 1])
+	session = trace->time[i - 1];
+      trace->time[i] = session;
+    }else{
+      trace->time[i] = session + r->time;
+    }
+  }
+  return(0);
+}
+
+/**
+ * Wait until a record is due (speed > 0)
+ */
+static void wait_until(REPLAY *replay, unsigned long long us)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double due = us / replay->speed / 1e6;
+  double elapsed = (now.tv_sec - replay->start.tv_sec) +
+    (now.tv_nsec - replay->start.tv_nsec) / 1e9;
+  if(due > elapsed)
+    usleep((useconds_t) ((due - elapsed) * 1e6));
+}
+
+/**
+ * Issue one block request
+ */
+static void replay_record(REPLAY *replay, VDISK_TRACE_RECORD *r, BLOCK *buffer)
+{
+  int op = r->op & ~VDISK_TRACE_CACHED;
+  BLOCK_REFERENCE b = r->block;
+  int slot = (replay->cache_blocks > 0) ? b % replay->cache_blocks : -1;
+  int hit = 0;
+
+  if(op == VDISK_TRACE_ATTACH || b >= N_BLOCKS)
+    return;
+
+  pthread_mutex_lock(&replay->lock);
+  switch(op) {
+  case VDISK_TRACE_READ:
+  case VDISK_TRACE_PIN:
+    hit = (slot >= 0 && replay->cache[slot] == b);
+    if(hit)
+      ++replay->n_hits;
+    else
+      ++replay->n_reads;
+    break;
+  case VDISK_TRACE_PREFETCH:
+    ++replay->n_prefetches;
+    break;
+  case VDISK_TRACE_WRITE:
+    ++replay->n_writes;
+    break;
+  case VDISK_TRACE_DISCARD:
+    ++replay->n_discards;
+    break;
+  }
+  // Reads and writes leave the block in the cache; discards remove it
+  if(slot >= 0)
+    replay->cache[slot] = (op == VDISK_TRACE_DISCARD) ? UNALLOCATED_BLOCK : b;
+  pthread_mutex_unlock(&replay->lock);
+
+  if(replay->fd < 0 || hit)
+    return;
+
+  int ret = BLOCK_SIZE;
+  if(op == VDISK_TRACE_READ || op == VDISK_TRACE_PIN || op == VDISK_TRACE_PREFETCH)
+    ret = pread(replay->fd, buffer, BLOCK_SIZE, (off_t) b * BLOCK_SIZE);
+  else if(op == VDISK_TRACE_WRITE && replay->write_blocks)
+    ret = pwrite(replay->fd, buffer, BLOCK_SIZE, (off_t) b * BLOCK_SIZE);
+  if(ret != BLOCK_SIZE) {
+    pthread_mutex_lock(&replay->lock);
+    ++replay->n_errors;
+    pthread_mutex_unlock(&replay->lock);
+  }
+}
+
+/**
+ * Thread: replay records first, first + n_threads, ...
+ */
+static void *worker(void *arg)
+{
+  WORKER *w = (WORKER *) arg;
+  REPLAY *replay = w->replay;
+  BLOCK buffer;
+
+  memset(&buffer, 0, sizeof(buffer));
+  for(int i = w->first; i < replay->trace->n_records; i += replay->n_threads) {
+    if(replay->speed > 0)
+      wait_until(replay, replay->trace->time[i]);
+    replay_record(replay, &replay->trace->records[i], &buffer);
+  }
+  return(NULL);
+}
+
+/**
+ * Print what the trace holds: requests by type and by library call
+ */
+static void trace_summary(TRACE *trace)
+{
+  unsigned long by_op[VDISK_TRACE_N_OPS] = {0};
+  unsigned long cached = 0;
+  unsigned long by_caller[OUFS_N_OPS + 1] = {0};
+
+  for(int i = 0; i < trace->n_records; ++i) {
+    VDISK_TRACE_RECORD *r = &trace->records[i];
+    int op = r->op & ~VDISK_TRACE_CACHED;
+    if(op < VDISK_TRACE_N_OPS)
+      ++by_op[op];
+    if(r->op & VDISK_TRACE_CACHED)
+      ++cached;
+    if(op != VDISK_TRACE_ATTACH)
+      ++by_caller[(r->caller < OUFS_N_OPS) ? r->caller : OUFS_N_OPS];
+  }
+
+  printf("Trace: %d records over %.3f s\n", trace->n_records,
+	 trace->n_records > 0 ? trace->time[trace->n_records - 1] / 1e6 : 0.0);
+  for(int op = 0; op < VDISK_TRACE_N_OPS; ++op)
+    printf("  %-10s %lu\n", op_names[op], by_op[op]);
+  printf("  (%lu reads and pins were served by the cache when captured)\n", cached);
+  printf("Requests by library call:\n");
+  for(int c = 0; c <= OUFS_N_OPS; ++c)
+    if(by_caller[c] > 0)
+      printf("  %-20s %lu\n", (c < OUFS_N_OPS) ? oufs_op_name(c) : "(none)", by_caller[c]);
+}
+
+int main(int argc, char **argv)
+{
+  REPLAY replay;
+  TRACE trace;
+  int null_backend = 0;
+  int i;
+
+  memset(&replay, 0, sizeof(replay));
+  replay.n_threads = 1;
+  replay.cache_blocks = VDISK_CACHE_BLOCKS;
+
+  // Options
+  for(i = 1; i < argc && argv[i][0] == '-'; ++i) {
+    if(strcmp(argv[i], "-n") == 0) {
+      null_backend = 1;
+    }else if(strcmp(argv[i], "-w") == 0) {
+      replay.write_blocks = 1;
+    }else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      replay.speed = atof(argv[++i]);
+    }else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      replay.n_threads = atoi(argv[++i]);
+    }else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      replay.cache_blocks = atoi(argv[++i]);
+    }else{
+      break;
+    }
+  }
+  if(i >= argc || i + 2 < argc || replay.n_threads < 1 || replay.cache_blocks < 0 ||
+     replay.speed < 0) {
+    fprintf(stderr, "Usage: oufs_replay [-n] [-w] [-t speed] [-j threads] [-c cache blocks] {trace} [image]\n");
+    return(-1);
+  }
+
+  if(trace_load(argv[i], &trace) != 0)
+    return(-1);
+  replay.trace = &trace;
+
+  // Backend
+  replay.fd = -1;
+  if(!null_backend) {
+    char cwd[MAX_PATH_LENGTH];
+    char disk_name[MAX_PATH_LENGTH];
+    char pipe_name_base[MAX_PATH_LENGTH];
+    oufs_get_environment(cwd, disk_name, pipe_name_base);
+    char *image = (i + 1 < argc) ? argv[i + 1] : disk_name;
+    replay.fd = open(image, replay.write_blocks ? O_RDWR : O_RDONLY);
+    if(replay.fd < 0) {
+      perror(image);
+      return(-1);
+    }
+  }
+
+  replay.cache = (BLOCK_REFERENCE *) malloc((replay.cache_blocks + 1) * sizeof(BLOCK_REFERENCE));
+  for(int s = 0; s < replay.cache_blocks; ++s)
+    replay.cache[s] = UNALLOCATED_BLOCK;
+  pthread_mutex_init(&replay.lock, NULL);
+
+  trace_summary(&trace);
+
+  // Replay
+  pthread_t *threads = (pthread_t *) malloc(replay.n_threads * sizeof(pthread_t));
+  WORKER *workers = (WORKER *) malloc(replay.n_threads * sizeof(WORKER));
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &replay.start);
+  for(int t = 0; t < replay.n_threads; ++t) {
+    workers[t].replay = &replay;
+    workers[t].first = t;
+    pthread_create(&threads[t], NULL, worker, &workers[t]);
+  }
+  for(int t = 0; t < replay.n_threads; ++t)
+    pthread_join(threads[t], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed = (end.tv_sec - replay.start.tv_sec) + (end.tv_nsec - replay.start.tv_nsec) / 1e9;
+  unsigned long n_requests = replay.n_reads + replay.n_hits + replay.n_prefetches +
+    replay.n_writes + replay.n_discards;
+  printf("Replay: %s backend, %d thread%s, cache of %d blocks, ",
+	 null_backend ? "null" : "image", replay.n_threads, (replay.n_threads == 1) ? "" : "s",
+	 replay.cache_blocks);
+  if(replay.speed > 0)
+    printf("speed %g\n", replay.speed);
+  else
+    printf("as fast as possible\n");
+  printf("  block reads %lu, cache hits %lu (%.1f%% of reads and pins), prefetched blocks %lu\n",
+	 replay.n_reads, replay.n_hits,
+	 (replay.n_reads + replay.n_hits > 0) ? 100.0 * replay.n_hits / (replay.n_reads + replay.n_hits) : 0.0,
+	 replay.n_prefetches);
+  printf("  block writes %lu%s, discards %lu (not replayed)\n", replay.n_writes,
+	 (replay.write_blocks && !null_backend) ? "" : " (not replayed)", replay.n_discards);
+  printf("  %lu requests in %.6f s (%.0f requests/s), %lu errors\n", n_requests, elapsed,
+	 (elapsed > 0) ? n_requests / elapsed : 0.0, replay.n_errors);
+
+  if(replay.fd >= 0)
+    close(replay.fd);
+  free(threads);
+  free(workers);
+  free(replay.cache);
+  free(trace.records);
+  free(trace.time);
+  return(replay.n_errors > 0);
+}
@@ -1,7 +1,14 @@
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "oufs.h"
+#include "oufs_metrics.h"
 
-int main(int argc, char **argv)
+/**
+ * Print the compile-time constants of the file system
+ */
+static void print_constants()
 {
   printf("BLOCK_SIZE: %d\n", BLOCK_SIZE);
   printf("N_BLOCKS: %d\n", N_BLOCKS);
@@ -11,5 +18,44 @@ int main(int argc, char **argv)
   printf("INODES_PER_BLOCK: %d\n", N_INODES_PER_BLOCK);
   printf("N_INODES: %d\n", N_INODES);
   printf("DIRECTORY_ENTRIES_PER_BLOCK: %d\n", N_DIRECTORY_ENTRIES_PER_BLOCK);
-  
+  printf("MAX_NAME_LENGTH: %d\n", OUFS_MAX_NAME_LENGTH);
+}
+
+int main(int argc, char **argv)
+{
+  if(argc == 1) {
+    print_constants();
+    return(0);
+  }
+
+  // Operation measurements, from the file that the oufs tools add them to
+  char *path = getenv("OUFS_METRICS");
+  if(argc != 2 || (strcmp(argv[1], "-m") != 0 && strcmp(argv[1], "-j") != 0 &&
+		   strcmp(argv[1], "-r") != 0)) {
+    fprintf(stderr, "Usage: oufs_stats [-m | -j | -r]\n");
+    return(-1);
+  }
+  if(path == NULL || path[0] == '\0') {
+    fprintf(stderr, "OUFS_METRICS is not set\n");
+    return(-1);
+  }
+
+  if(strcmp(argv[1], "-r") == 0) {
+    if(unlink(path) != 0) {
+      perror(path);
+      return(-1);
+    }
+    return(0);
+  }
+
+  OUFS_METRICS metrics;
+  if(oufs_metrics_load(path, &metrics) != 0) {
+    fprintf(stderr, "%s is not a metrics file\n", path);
+    return(-1);
+  }
+  if(strcmp(argv[1], "-j") == 0)
+    oufs_metrics_print_json(stdout, &metrics);
+  else
+    oufs_metrics_print(stdout, &metrics);
+  return(0);
 }
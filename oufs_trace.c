@@ -0,0 +1,178 @@
+/**
+ *  oufs_trace.c
+ *
+ *  Event tracing for the library (built only with OUFS_TRACE defined).
+ *
+ *  Each thread records its events, in binary, into its own ring buffer:
+ *  recording an event takes a clock read and a store, with no locks and
+ *  no I/O.  The rings are linked into a list (with an atomic push) when
+ *  a thread records its first event, so that they can all be dumped.
+ *
+ *  If the environment variable OUFS_TRACE names a file ("-" for stderr),
+ *  the events still held in the rings are written to it as text when the
+ *  program exits: one event per line, in time order,
+ *    <time in ns> <thread> <event> <a> <b>
+ */
+
+#ifdef OUFS_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oufs.h"
+#include "oufs_trace.h"
+
+// Names of the events, in TRACE_EVENT order
+static const char *event_names[TRACE_N_EVENTS] = {
+  "inode_read", "inode_write", "inode_read_inline", "find_file",
+  "name_too_long", "directory_lookup", "blocks_allocate", "block_free",
+  "no_blocks", "fopen_error", "mkdir_error", "list_error", "fwrite",
+  "fread", "fread_views"
+};
+
+// One recorded event
+typedef struct
+{
+  unsigned long long ns;
+  unsigned short event;
+  unsigned short thread;
+  int a;
+  int b;
+} TRACE_RECORD;
+
+// The events of one thread.  Only that thread writes to it
+typedef struct trace_ring_s
+{
+  struct trace_ring_s *next;
+  unsigned short thread;
+  unsigned long head;
+  TRACE_RECORD records[OUFS_TRACE_RING_SIZE];
+} TRACE_RING;
+
+static TRACE_RING *rings = NULL;
+static unsigned short n_threads = 0;
+static __thread TRACE_RING *ring = NULL;
+
+/**
+ * atexit() handler: dump the events to the OUFS_TRACE file
+ */
+static void dump_at_exit()
+{
+  char *path = getenv("OUFS_TRACE");
+  if(path != NULL && path[0] != '\0')
+    oufs_trace_dump(path);
+}
+
+/**
+ * Give the calling thread its ring buffer
+ *
+ * @return 0 if success; -1 if out of memory
+ */
+static int ring_create()
+{
+  TRACE_RING *r = (TRACE_RING *) calloc(1, sizeof(TRACE_RING));
+  if(r == NULL)
+    return(-1);
+
+  r->thread = __atomic_fetch_add(&n_threads, 1, __ATOMIC_RELAXED);
+  if(r->thread == 0 && getenv("OUFS_TRACE") != NULL)
+    atexit(dump_at_exit);
+
+  // Push onto the list of rings
+  r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE,
+				     __ATOMIC_RELAXED))
+    ;
+  ring = r;
+  return(0);
+}
+
+/**
+ * Record an event in the calling thread's ring buffer
+ *
+ * @param event What happened
+ * @param a First argument of the event
+ * @param b Second argument of the event
+ */
+void oufs_trace_record(TRACE_EVENT event, int a, int b)
+{
+  struct timespec ts;
+
+  if(ring == NULL && ring_create() != 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  TRACE_RECORD *r = &ring->records[ring->head % OUFS_TRACE_RING_SIZE];
+  r->ns = (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  r->event = event;
+  r->thread = ring->thread;
+  r->a = a;
+  r->b = b;
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Name of an event
+ */
+const char *oufs_trace_event_name(TRACE_EVENT event)
+{
+  if(event < 0 || event >= TRACE_N_EVENTS)
+    return("unknown");
+  return(event_names[event]);
+}
+
+/**
+ * qsort() comparison: by time
+ */
+static int record_compare(const void *a, const void *b)
+{
+  const TRACE_RECORD *ra = (const TRACE_RECORD *) a;
+  const TRACE_RECORD *rb = (const TRACE_RECORD *) b;
+  return((ra->ns > rb->ns) - (ra->ns < rb->ns));
+}
+
+/**
+ * Write the events held in all of the ring buffers to a file, as text,
+ *   in time order
+ *
+ * @param path Name of the file ("-" for stderr)
+ * @return The number of events written
+ *         -x if error
+ */
+int oufs_trace_dump(char *path)
+{
+  int n = 0;
+
+  // Copy out the events (the newest OUFS_TRACE_RING_SIZE of each thread)
+  for(TRACE_RING *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+    n += MIN(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE), OUFS_TRACE_RING_SIZE);
+  TRACE_RECORD *records = (TRACE_RECORD *) malloc((n + 1) * sizeof(TRACE_RECORD));
+  if(records == NULL)
+    return(-1);
+
+  int k = 0;
+  for(TRACE_RING *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+    unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned long first = (head > OUFS_TRACE_RING_SIZE) ? head - OUFS_TRACE_RING_SIZE : 0;
+    for(unsigned long i = first; i < head && k < n; ++i)
+      records[k++] = r->records[i % OUFS_TRACE_RING_SIZE];
+  }
+  qsort(records, k, sizeof(TRACE_RECORD), record_compare);
+
+  FILE *fp = (strcmp(path, "-") == 0) ? stderr : fopen(path, "a");
+  if(fp == NULL) {
+    free(records);
+    return(-2);
+  }
+  for(int i = 0; i < k; ++i)
+    fprintf(fp, "%llu %d %s %d %d\n", records[i].ns, records[i].thread,
+	    oufs_trace_event_name(records[i].event), records[i].a, records[i].b);
+  if(fp != stderr)
+    fclose(fp);
+  free(records);
+  return(k);
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef OUFS_TRACE_H
+#define OUFS_TRACE_H
+
+// Events recorded by the library when it is built with OUFS_TRACE defined
+//  (make TRACE=1).  Each event carries two integers; their meaning is
+//  given next to the event
+typedef enum {
+  TRACE_INODE_READ = 0,		// inode, 0
+  TRACE_INODE_WRITE,		// inode, 0
+  TRACE_INODE_READ_INLINE,	// inode, 0
+  TRACE_FIND_FILE,		// parent, child
+  TRACE_NAME_TOO_LONG,		// directory inode, name length
+  TRACE_DIRECTORY_LOOKUP,	// directory block, entry index (or -1)
+  TRACE_BLOCKS_ALLOCATE,	// first block, number of blocks (maybe not a run)
+  TRACE_BLOCK_FREE,		// block, 0
+  TRACE_NO_BLOCKS,		// blocks wanted, 0
+  TRACE_FOPEN_ERROR,		// error, 0
+  TRACE_MKDIR_ERROR,		// error, 0
+  TRACE_LIST_ERROR,		// error, 0
+  TRACE_FWRITE,			// inode, number of buffers
+  TRACE_FREAD,			// inode, number of buffers
+  TRACE_FREAD_VIEWS,		// inode, bytes
+  TRACE_N_EVENTS
+} TRACE_EVENT;
+
+#ifdef OUFS_TRACE
+
+// Events kept per thread: older events are overwritten
+#define OUFS_TRACE_RING_SIZE 4096
+
+void oufs_trace_record(TRACE_EVENT event, int a, int b);
+int oufs_trace_dump(char *path);
+const char *oufs_trace_event_name(TRACE_EVENT event);
+
+#define OUFS_TRACE_EVENT(event, a, b) oufs_trace_record((event), (int) (a), (int) (b))
+
+#else
+
+// Tracing is compiled out: the arguments are not even evaluated
+#define OUFS_TRACE_EVENT(event, a, b) ((void) 0)
+
+#endif
+
+#endif
@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+#include "virtual_disk.h"
+
+int main(int argc, char **argv)
+{
+  // Get the environmental variables
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  char pipe_name_base[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name, pipe_name_base);
+
+  // Open the virtual disk
+  if(virtual_disk_attach(disk_name, pipe_name_base) != 0) {
+    return(-1);
+  }
+
+  // Give the free blocks back to the host
+  int n = oufs_trim();
+  if(n < 0) {
+    fprintf(stderr, "Error (%d)\n", n);
+  }else{
+    printf("Discarded %d free blocks\n", n);
+  }
+
+  // Clean up
+  virtual_disk_detach();
+
+  return(0);
+}
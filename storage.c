@@ -1,5 +1,8 @@
 //Camron Bartlow Project 2
 
+// fallocate() and its hole punching flags
+#define _GNU_SOURCE
+#include <errno.h>
 #include "storage.h"
 
 /**
@@ -120,3 +123,50 @@ int put_bytes(STORAGE *storage, unsigned char *buf, int location, int len)
   return(ret);
 };
 
+
+/**
+ *  Tell the storage file that a range of bytes is no longer needed.  The
+ *  host file system can release the space; the range reads as zeros
+ *  afterwards and the size of the file does not change.
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param location The first byte of the range
+ * @param len The number of bytes in the range
+ * @return -1 if an error;
+ *         0 if success (or if the host file system cannot discard)
+ */
+int discard_bytes(STORAGE *storage, int location, int len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if(fallocate(storage->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, location, len) < 0) {
+    // Not supported here: the bytes just stay where they are
+    if(errno == EOPNOTSUPP || errno == ENOSYS)
+      return(0);
+    fprintf(stderr, "Unable to discard\n");
+    return(-1);
+  };
+#endif
+
+  // Success
+  return(0);
+};
+
+
+/**
+ *  Empty the storage file: it is cut to zero length and then extended to
+ *  len bytes, which all read as zeros (and take no space on the host).
+ *
+ * @param storage A pointer to an initialized storage object
+ * @param len The new length of the file in bytes
+ * @return -1 if an error; 0 on success
+ */
+int clear_storage(STORAGE *storage, int len)
+{
+  if(ftruncate(storage->fd, 0) < 0 || ftruncate(storage->fd, len) < 0) {
+    fprintf(stderr, "Unable to truncate\n");
+    return(-1);
+  };
+
+  // Success
+  return(0);
+};
@@ -15,4 +15,6 @@ STORAGE * init_storage(char * name, char *pipe_name_base);
 int close_storage(STORAGE *storage);
 int get_bytes(STORAGE *storage, unsigned char *buf, int location, int len);
 int put_bytes(STORAGE *storage, unsigned char *buf, int location, int len);
+int discard_bytes(STORAGE *storage, int location, int len);
+int clear_storage(STORAGE *storage, int len);
 
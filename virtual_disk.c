@@ -8,6 +8,8 @@
  */
 
 
+#include <time.h>
+
 #include "oufs.h"
 #include "storage.h"
 #include "virtual_disk.h"
@@ -16,6 +18,105 @@
 //  this case.
 STORAGE *storage = NULL;
 
+// Block cache: direct-mapped on the block reference.  Writes go through
+//  to the storage file, so a cached block always matches the disk.
+// A pinned entry is in use by a caller that holds a pointer into it and
+//  is never evicted.
+typedef struct
+{
+  BLOCK_REFERENCE block_ref;
+  int pins;
+  BLOCK block;
+} CACHE_ENTRY;
+
+static CACHE_ENTRY cache[VDISK_CACHE_BLOCKS];
+
+// Block I/O totals (virtual_disk_get_counters())
+static VDISK_COUNTERS counters;
+
+// Block I/O trace (OUFS_IO_TRACE): the open trace file, when the session
+//  started, and the library call that is making requests
+static FILE *trace = NULL;
+static struct timespec trace_start;
+static int trace_caller = VDISK_TRACE_NO_CALLER;
+
+/**
+ * Append one record to the block I/O trace (if it is being captured)
+ *
+ * @param op VDISK_TRACE_OP, plus VDISK_TRACE_CACHED
+ * @param block_ref The block
+ */
+static void trace_record(int op, BLOCK_REFERENCE block_ref)
+{
+  struct timespec now;
+  VDISK_TRACE_RECORD record;
+
+  if(trace == NULL)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  record.time = (now.tv_sec - trace_start.tv_sec) * 1000000 +
+    (now.tv_nsec - trace_start.tv_nsec) / 1000;
+  record.block = block_ref;
+  record.op = op;
+  record.caller = trace_caller;
+  fwrite(&record, sizeof(record), 1, trace);
+}
+
+/**
+ * Start capturing a block I/O trace, if OUFS_IO_TRACE names a file
+ */
+static void trace_open()
+{
+  char *path = getenv("OUFS_IO_TRACE");
+  VDISK_TRACE_RECORD record;
+
+  if(path == NULL || path[0] == '\0' || (trace = fopen(path, "a")) == NULL)
+    return;
+
+  // A new file gets the header
+  if(ftell(trace) == 0) {
+    VDISK_TRACE_HEADER header;
+    memcpy(header.magic, VDISK_TRACE_MAGIC, 8);
+    header.block_size = BLOCK_SIZE;
+    header.n_blocks = N_BLOCKS;
+    fwrite(&header, sizeof(header), 1, trace);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &trace_start);
+  record.time = (unsigned int) time(NULL);
+  record.block = UNALLOCATED_BLOCK;
+  record.op = VDISK_TRACE_ATTACH;
+  record.caller = VDISK_TRACE_NO_CALLER;
+  fwrite(&record, sizeof(record), 1, trace);
+}
+
+/**
+ * Forget everything that is held in the block cache
+ */
+static void cache_invalidate()
+{
+  for(int i = 0; i < VDISK_CACHE_BLOCKS; ++i) {
+    cache[i].block_ref = UNALLOCATED_BLOCK;
+    cache[i].pins = 0;
+  }
+}
+
+/**
+ * Place a copy of a block into the cache (unless its slot is pinned by
+ *  another block)
+ *
+ * @param block_ref Integer index of the block
+ * @param block Buffer containing the block
+ */
+static void cache_insert(BLOCK_REFERENCE block_ref, void *block)
+{
+  CACHE_ENTRY *entry = &cache[block_ref % VDISK_CACHE_BLOCKS];
+  if(entry->pins > 0 && entry->block_ref != block_ref)
+    return;
+  entry->block_ref = block_ref;
+  memcpy(&entry->block, block, BLOCK_SIZE);
+}
+
 /**
  *  Atttach to the specified virtual disk
  *
@@ -28,6 +129,9 @@ int virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base)
 {
   // Initialize the general storage system
   storage = init_storage(virtual_disk_name, pipe_name_base);
+  cache_invalidate();
+  if(storage != NULL)
+    trace_open();
 
   // Parse result
   if(storage == NULL) 
@@ -49,6 +153,11 @@ int virtual_disk_detach()
   if(storage == NULL)
     return(-1);
   int ret = close_storage(storage);
+  cache_invalidate();
+  if(trace != NULL) {
+    fclose(trace);
+    trace = NULL;
+  }
 
   storage = NULL;
   return(ret);
@@ -69,14 +178,111 @@ int virtual_disk_read_block(BLOCK_REFERENCE block_ref, void *block)
     return(-1);
   };
 
+  // Cache hit?
+  CACHE_ENTRY *entry = &cache[block_ref % VDISK_CACHE_BLOCKS];
+  if(entry->block_ref == block_ref) {
+    memcpy(block, &entry->block, BLOCK_SIZE);
+    ++counters.n_cache_hits;
+    trace_record(VDISK_TRACE_READ | VDISK_TRACE_CACHED, block_ref);
+    return(0);
+  }
+
   // Read the bytes
   int ret = get_bytes(storage, block, block_ref * BLOCK_SIZE, BLOCK_SIZE);
-  if(ret > 0)
+  ++counters.n_reads;
+  trace_record(VDISK_TRACE_READ, block_ref);
+  if(ret > 0) {
     // Success
+    cache_insert(block_ref, block);
+    return(0);
+  }else
+    // Error
+    return(-1);
+}
+
+/**
+ * Write a run of consecutive blocks to the storage file with a single
+ *  storage request
+ *
+ * @param block_ref Integer index of the first block of the run
+ * @param n_blocks Number of blocks to write
+ * @param blocks Buffer containing the n_blocks blocks
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_write_blocks(BLOCK_REFERENCE block_ref, int n_blocks, void *blocks)
+{
+  if(n_blocks <= 0 || block_ref >= N_BLOCKS || n_blocks > N_BLOCKS - block_ref) {
+    return(-1);
+  };
+
+  // Write the bytes
+  int ret = put_bytes(storage, blocks, block_ref * BLOCK_SIZE, n_blocks * BLOCK_SIZE);
+  counters.n_writes += n_blocks;
+  for(int i = 0; i < n_blocks; ++i)
+    trace_record(VDISK_TRACE_WRITE, block_ref + i);
+
+  for(int i = 0; i < n_blocks; ++i) {
+    CACHE_ENTRY *entry = &cache[(block_ref + i) % VDISK_CACHE_BLOCKS];
+    if(ret == n_blocks * BLOCK_SIZE)
+      // Keep the cache in step with the disk
+      cache_insert(block_ref + i, (BLOCK *) blocks + i);
+    else if(entry->block_ref == block_ref + i && entry->pins == 0)
+      entry->block_ref = UNALLOCATED_BLOCK;
+  }
+
+  return((ret == n_blocks * BLOCK_SIZE) ? 0 : -1);
+}
+
+/**
+ *  Read a run of consecutive blocks into the block cache with a single
+ *  storage request.  Used for readahead: blocks that are already cached
+ *  are simply refreshed.
+ *
+ * @param block_ref Integer index of the first block of the run
+ * @param n_blocks Number of blocks to read (clipped to the end of the disk
+ *          and to the size of the cache)
+ * @return -1 if an error has occurred; otherwise the number of blocks read
+ */
+int virtual_disk_prefetch_blocks(BLOCK_REFERENCE block_ref, int n_blocks)
+{
+  static BLOCK run[VDISK_CACHE_BLOCKS];
+
+  if(block_ref >= N_BLOCKS) {
+    // Improper ref
+    return(-1);
+  }
+  n_blocks = MIN(n_blocks, MIN(N_BLOCKS - block_ref, VDISK_CACHE_BLOCKS));
+  if(n_blocks <= 0)
     return(0);
-  else
+
+  // Read the whole run at once
+  int ret = get_bytes(storage, (unsigned char *) run, block_ref * BLOCK_SIZE,
+		      n_blocks * BLOCK_SIZE);
+  counters.n_reads += n_blocks;
+  for(int i = 0; i < n_blocks; ++i)
+    trace_record(VDISK_TRACE_PREFETCH, block_ref + i);
+  if(ret < BLOCK_SIZE)
     // Error
     return(-1);
+
+  // Only complete blocks are usable
+  n_blocks = ret / BLOCK_SIZE;
+  for(int i = 0; i < n_blocks; ++i)
+    cache_insert(block_ref + i, &run[i]);
+
+  return(n_blocks);
+}
+
+/**
+ *  Report whether a block can be read without touching the storage file
+ *
+ * @param block_ref Integer index of the block
+ * @return 1 if the block is in the cache; 0 otherwise
+ */
+int virtual_disk_block_is_cached(BLOCK_REFERENCE block_ref)
+{
+  return(block_ref < N_BLOCKS &&
+	 cache[block_ref % VDISK_CACHE_BLOCKS].block_ref == block_ref);
 }
 /**
  * Write the specified block to the storage file
@@ -94,12 +300,136 @@ int virtual_disk_write_block(BLOCK_REFERENCE block_ref, void *block)
 
   // Write the bytes
   int ret = put_bytes(storage, block, block_ref * BLOCK_SIZE, BLOCK_SIZE);
-  
-  if(ret > 0)
-    // SUccess
+  ++counters.n_writes;
+  trace_record(VDISK_TRACE_WRITE, block_ref);
+
+  if(ret > 0) {
+    // SUccess: keep the cache in step with the disk
+    cache_insert(block_ref, block);
     return(0);
-  else
-    // Error
+  }else{
+    // Error: the disk contents are unknown now
+    CACHE_ENTRY *entry = &cache[block_ref % VDISK_CACHE_BLOCKS];
+    if(entry->block_ref == block_ref && entry->pins == 0)
+      entry->block_ref = UNALLOCATED_BLOCK;
+    return(-1);
+  }
+}
+
+/**
+ *  Discard a run of consecutive blocks that are no longer in use: the
+ *  storage file gives their space back to the host, and they read as
+ *  zeros afterwards
+ *
+ * @param block_ref Integer index of the first block of the run
+ * @param n_blocks Number of blocks to discard
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_discard_blocks(BLOCK_REFERENCE block_ref, int n_blocks)
+{
+  if(n_blocks <= 0 || block_ref >= N_BLOCKS || n_blocks > N_BLOCKS - block_ref) {
     return(-1);
+  };
+
+  // The cached copies no longer match the disk
+  for(int i = 0; i < n_blocks; ++i) {
+    CACHE_ENTRY *entry = &cache[(block_ref + i) % VDISK_CACHE_BLOCKS];
+    if(entry->block_ref == block_ref + i && entry->pins == 0)
+      entry->block_ref = UNALLOCATED_BLOCK;
+    trace_record(VDISK_TRACE_DISCARD, block_ref + i);
+  }
+
+  return(discard_bytes(storage, block_ref * BLOCK_SIZE, n_blocks * BLOCK_SIZE));
+}
+
+/**
+ *  Zero the whole disk at once, without writing any blocks
+ *
+ * @return -1 if an error has occurred; 0 if successful
+ */
+int virtual_disk_clear()
+{
+  cache_invalidate();
+  for(int i = 0; i < N_BLOCKS; ++i)
+    trace_record(VDISK_TRACE_DISCARD, i);
+  return(clear_storage(storage, N_BLOCKS * BLOCK_SIZE));
+}
+
+/**
+ *  Pin a block in the cache and return a pointer to the cached copy.
+ *  The block stays valid (and is kept up to date by later writes) until
+ *  it is released with virtual_disk_unpin_block().  Pins nest.
+ *
+ * @param block_ref Integer index of the block
+ * @return Pointer to the cached block; NULL if the block cannot be read
+ *         or its cache slot is pinned by another block
+ */
+BLOCK *virtual_disk_pin_block(BLOCK_REFERENCE block_ref)
+{
+  if(block_ref >= N_BLOCKS) {
+    // Improper ref
+    return(NULL);
+  }
+
+  CACHE_ENTRY *entry = &cache[block_ref % VDISK_CACHE_BLOCKS];
+  if(entry->block_ref != block_ref) {
+    if(entry->pins > 0)
+      // Slot busy
+      return(NULL);
+
+    // Load the block straight into the cache
+    entry->block_ref = UNALLOCATED_BLOCK;
+    ++counters.n_reads;
+    trace_record(VDISK_TRACE_PIN, block_ref);
+    if(get_bytes(storage, (unsigned char *) &entry->block,
+		 block_ref * BLOCK_SIZE, BLOCK_SIZE) <= 0)
+      return(NULL);
+    entry->block_ref = block_ref;
+  }else{
+    ++counters.n_cache_hits;
+    trace_record(VDISK_TRACE_PIN | VDISK_TRACE_CACHED, block_ref);
+  }
+
+  ++entry->pins;
+  return(&entry->block);
+}
+
+/**
+ *  Release one pin taken by virtual_disk_pin_block()
+ *
+ * @param address Any address within the pinned block
+ */
+void virtual_disk_unpin_block(void *address)
+{
+  char *p = (char *) address;
+  if(p < (char *) cache || p >= (char *) (cache + VDISK_CACHE_BLOCKS))
+    return;
+
+  CACHE_ENTRY *entry = &cache[(p - (char *) cache) / sizeof(CACHE_ENTRY)];
+  if(entry->pins > 0)
+    --entry->pins;
+}
+
+/**
+ *  Report the block I/O done since the program started
+ *
+ * @param c Filled in with the running totals
+ */
+void virtual_disk_get_counters(VDISK_COUNTERS *c)
+{
+  *c = counters;
+}
 
+/**
+ *  Set the library call that the following block requests are made for
+ *  (recorded in the block I/O trace)
+ *
+ * @param caller OUFS_OP of the call; VDISK_TRACE_NO_CALLER if none
+ * @return The previous caller, to be restored when the call returns
+ */
+int virtual_disk_set_caller(int caller)
+{
+  int previous = trace_caller;
+  trace_caller = caller;
+  return(previous);
 }
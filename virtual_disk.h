@@ -1,4 +1,5 @@
 #ifndef VDISK_H
+#define VDISK_H
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -8,9 +9,73 @@
 #include <stdio.h>
 #include "oufs.h"
 
+// Number of blocks held in the (write-through) block cache
+#define VDISK_CACHE_BLOCKS 64
+
+// Running totals of block I/O since the program started
+typedef struct
+{
+  // Blocks read from / written to the storage file
+  unsigned long n_reads;
+  unsigned long n_writes;
+
+  // Block reads (and pins) served by the cache
+  unsigned long n_cache_hits;
+} VDISK_COUNTERS;
+
+// Block I/O trace: if the environment variable OUFS_IO_TRACE names a file,
+//  virtual_disk_attach() appends a record of every block request to it.
+//  The file starts with a VDISK_TRACE_HEADER; each attach starts a session
+//  with a VDISK_TRACE_ATTACH record
+#define VDISK_TRACE_MAGIC "OUFSIOTR"
+
+typedef struct
+{
+  char magic[8];
+  int block_size;
+  int n_blocks;
+} VDISK_TRACE_HEADER;
+
+typedef enum {
+  VDISK_TRACE_READ = 0,
+  VDISK_TRACE_WRITE,
+  VDISK_TRACE_PREFETCH,
+  VDISK_TRACE_DISCARD,
+  VDISK_TRACE_PIN,
+  VDISK_TRACE_ATTACH,
+  VDISK_TRACE_N_OPS
+} VDISK_TRACE_OP;
+
+// Added to op when the cache served the request
+#define VDISK_TRACE_CACHED 0x80
+
+// caller when the request was not made inside a measured library call
+#define VDISK_TRACE_NO_CALLER 0xff
+
+typedef struct
+{
+  // Microseconds since the session started (VDISK_TRACE_ATTACH: the start
+  //  of the session, in seconds since the epoch)
+  unsigned int time;
+  BLOCK_REFERENCE block;
+  // VDISK_TRACE_OP, plus VDISK_TRACE_CACHED
+  unsigned char op;
+  // OUFS_OP of the innermost measured library call (oufs_metrics.h)
+  unsigned char caller;
+} VDISK_TRACE_RECORD;
+
 int virtual_disk_attach(char *virtual_disk_name, char *pipe_name_base);
 int virtual_disk_detach();
 int virtual_disk_read_block(BLOCK_REFERENCE block_ref, void *block);
 int virtual_disk_write_block(BLOCK_REFERENCE block_ref, void *block);
+int virtual_disk_write_blocks(BLOCK_REFERENCE block_ref, int n_blocks, void *blocks);
+int virtual_disk_prefetch_blocks(BLOCK_REFERENCE block_ref, int n_blocks);
+int virtual_disk_discard_blocks(BLOCK_REFERENCE block_ref, int n_blocks);
+int virtual_disk_clear();
+int virtual_disk_block_is_cached(BLOCK_REFERENCE block_ref);
+BLOCK *virtual_disk_pin_block(BLOCK_REFERENCE block_ref);
+void virtual_disk_unpin_block(void *address);
+void virtual_disk_get_counters(VDISK_COUNTERS *counters);
+int virtual_disk_set_caller(int caller);
 
 #endif